@@ -58,7 +58,7 @@ typedef struct _txt {
 
 // Prototypes for dnssd.c
 
-result_t *dnssd_browse(void);
+result_t *dnssd_browse(const char *types);
 
 
 // Prototypes for install.c
@@ -81,6 +81,7 @@ char *util_strcpy(char *dst, const char *src, size_t len);
 char *util_strcat(char *dst, const char *src, size_t len);
 char *util_strtrim(char *src, const char *trim);
 char *util_append(char *dst, size_t len, char *fmt, ...);
+size_t util_json_escape(char *dst, size_t len, const char *src);
 
 void util_inc_verbose(void);
 int  util_get_verbose(void);
@@ -33,6 +33,7 @@
 #include <arpa/inet.h>
 
 #define POLL_TIMEOUT	1000
+#define DNSSD_TYPES	16		// service types per lookup
 
 
 typedef struct _record {
@@ -55,6 +56,9 @@ static DNSServiceRef  my_client  = NULL;
 static int            my_done;
 static record_t      *my_records = NULL;
 
+static int            my_browse_cnt = 0;	// one browser per service type
+static int            my_browsed[DNSSD_TYPES];	// first batch seen
+
 
 static void
 dnssd_cleanup(void)
@@ -157,6 +161,18 @@ dnssd_zonedata_browse(DNSServiceRef   sdref,
 		void                  *context)
 {
 	record_t *record;
+	int idx, cnt;
+
+	//
+	// Collecting ends when every browser delivered its first batch
+	//
+	if ((flags & kDNSServiceFlagsMoreComing) == 0) {
+		my_browsed[(intptr_t) context] = 1;
+		for (idx = cnt = 0; idx < my_browse_cnt; idx++) {
+			cnt += my_browsed[idx];
+		}
+		my_done = (cnt == my_browse_cnt);
+	}
 
 	if ((flags & kDNSServiceFlagsAdd) == 0) {
 		return;
@@ -178,11 +194,7 @@ dnssd_zonedata_browse(DNSServiceRef   sdref,
 	record->next        = my_records;
 	my_records = record;
 
-	util_info("found '%s'", replyName);
-
-	if ((flags & kDNSServiceFlagsMoreComing) == 0) {
-		my_done = 1;
-	}
+	util_info("found '%s' (%s)", replyName, replyType);
 }
 
 
@@ -258,13 +270,19 @@ dnssd_event_loop(char *target)
 }
 
 
+/*
+ * The types are a comma separated list like "_http._tcp,_ipp._tcp",
+ * each one gets a browser on the shared connection and all of them
+ * are collected in one round.
+ */
+
 result_t *
-dnssd_browse(void)
+dnssd_browse(const char *types)
 {
 	int err;
-	DNSServiceRef browser;
+	DNSServiceRef browsers[DNSSD_TYPES];
 	record_t *record;
-	char answer[4096], url[1024];
+	char answer[8192], tail[4096], url[1024], escaped[2048], list[1024], *type, *save;
 	result_t *result;
 	txt_t *ptr;
 
@@ -278,18 +296,31 @@ dnssd_browse(void)
 	util_debug(__func__, __LINE__, 2, "DNSServiceCreateConnection fd=%d", DNSServiceRefSockFD(my_client));
 
 	//
-	// Step 1: collect all servers
+	// Step 1: collect all servers of all types
 	//
-	browser = my_client;
-	err = DNSServiceBrowse(&browser,
-			kDNSServiceFlagsShareConnection,
-			kDNSServiceInterfaceIndexAny,
-			"_http._tcp",
-			"local",
-			dnssd_zonedata_browse,
-			NULL);
-	if (err != kDNSServiceErr_NoError) {
-		util_fatal("DNSServiceBrowse error %d", err);
+	UTIL_STRCPY(list, types);
+	for (type = strtok_r(list, ", ", &save); type != NULL; type = strtok_r(NULL, ", ", &save)) {
+		if (my_browse_cnt == DNSSD_TYPES) {
+			util_error(__func__, __LINE__, "too many service types, skip '%s'", type);
+			continue;
+		}
+		browsers[my_browse_cnt] = my_client;
+		err = DNSServiceBrowse(&browsers[my_browse_cnt],
+				kDNSServiceFlagsShareConnection,
+				kDNSServiceInterfaceIndexAny,
+				type,
+				"local",
+				dnssd_zonedata_browse,
+				(void *) (intptr_t) my_browse_cnt);
+		if (err != kDNSServiceErr_NoError) {
+			util_error(__func__, __LINE__, "DNSServiceBrowse %s error %d", type, err);
+			continue;
+		}
+		util_debug(__func__, __LINE__, 2, "browsing for %s", type);
+		my_browse_cnt++;
+	}
+	if (my_browse_cnt == 0) {
+		util_fatal("no valid service type in '%s'", types);
 	}
 	dnssd_event_loop("collect");
 
@@ -358,27 +389,40 @@ dnssd_browse(void)
 			ptr->next = record->txt;
 			record->txt = ptr;
 		}
-		snprintf(url, sizeof(url), "http://%s:%u/", record->address, record->port);
+		snprintf(url, sizeof(url), "%s://%s:%u/",
+				strncmp(record->replyType, "_https._tcp", 11) == 0 ? "https" : "http",
+				record->address, record->port);
 		(void) util_strtrim(record->hostname, ".");
+		(void) util_strtrim(record->replyType, ".");
+
+		//
+		// The fields after the TXT list are formatted first, TXT strings
+		// that would not leave room for them are dropped so that the
+		// entry stays valid JSON
+		//
+		util_json_escape(escaped, sizeof(escaped), record->hostname);
+		snprintf(tail, sizeof(tail), "],\n"
+				"      \"target\": \"%s\",\n"
+				"      \"port\": %u,\n"
+				"      \"a\": \"%s\",\n"
+				"      \"url\": \"%s\",\n"
+				"      \"type\": \"%s\"\n",
+				escaped, record->port, record->address, url, record->replyType);
 
 		UTIL_STRCPY(answer, "    {\n");
-		util_append(answer, sizeof(answer), "      \"name\": \"%s\",\n",   record->replyName);
+		util_json_escape(escaped, sizeof(escaped), record->replyName);
+		util_append(answer, sizeof(answer), "      \"name\": \"%s\",\n",   escaped);
 
 		util_append(answer, sizeof(answer), "      \"txt\": [ ");
 		for (ptr = record->txt; ptr != NULL; ptr = ptr->next) {
-			util_append(answer, sizeof(answer), "\"%s\"", ptr->text);
-			if (ptr->next != NULL) {
-				util_append(answer, sizeof(answer), ", ");
-			} else {
-				util_append(answer, sizeof(answer), " ");
+			util_json_escape(escaped, sizeof(escaped), ptr->text);
+			if (strlen(answer) + strlen(escaped) + strlen(tail) + 16 > sizeof(answer)) {
+				util_debug(__func__, __LINE__, 1, "TXT of %s too long, rest dropped", record->replyName);
+				break;
 			}
+			util_append(answer, sizeof(answer), "%s\"%s\"", ptr != record->txt ? ", " : "", escaped);
 		}
-		util_append(answer, sizeof(answer), "],\n");
-
-		util_append(answer, sizeof(answer), "      \"target\": \"%s\",\n", record->hostname);
-		util_append(answer, sizeof(answer), "      \"port\": %u,\n",       record->port);
-		util_append(answer, sizeof(answer), "      \"a\": \"%s\",\n",      record->address);
-		util_append(answer, sizeof(answer), "      \"url\": \"%s\"\n",     url);
+		util_append(answer, sizeof(answer), "%s%s", record->txt != NULL ? " " : "", tail);
 		UTIL_STRCAT(answer, "    }");
 
 		for (result = my_results; result != NULL; result = result->next) {
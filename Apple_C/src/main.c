@@ -31,9 +31,11 @@
 #include <mach-o/dyld.h>
 #include <getopt.h>
 #include <poll.h>
+#include <ctype.h>
 
 
 #define LOG_FILE	"/tmp/zeroconf_lookup.log"
+#define SERVICE_TYPES	"_http._tcp"
 
 
 static struct option long_options[] = {
@@ -43,10 +45,11 @@ static struct option long_options[] = {
 	{ "readable",  no_argument, NULL, 'r' },
 	{ "uninstall", no_argument, NULL, 'u' },
 	{ "verbose",   no_argument, NULL, 'v' },
+	{ "types",     required_argument, NULL, 'y' },
 	{ NULL, 0, NULL, 0 }
 };
 
-static char     my_input[64];
+static char     my_input[4096];
 static length_t my_length;
 static size_t   my_length_offset = 0;
 static size_t   my_input_offset;
@@ -66,6 +69,8 @@ main_usage(char *name, int retval)
 	fprintf(fp, "      -r|--readable              Use human readable length for output\n");
 	fprintf(fp, "      -u|--uninstall             Uninstall Firefox/Chrome manifests (sudo for system wide)\n");
 	fprintf(fp, "      -v|--verbose               Increase verbosity level\n");
+	fprintf(fp, "      -y|--types=<list>          Service types to browse, comma separated\n");
+	fprintf(fp, "                                     Default: %s\n", SERVICE_TYPES);
 	fprintf(fp, "\n");
 
 	exit(retval);
@@ -101,7 +106,7 @@ main_input_byte(char chr)
 	}
 
 	if (++my_input_offset == my_length.as_uint) {
-		util_info("input complete: '%s'", util_strtrim(my_input, "\""));
+		util_info("input complete: '%s'", my_input);
 		return 1;
 	}
 
@@ -137,6 +142,200 @@ main_receive_input(void)
 }
 
 
+static char *
+main_skip_space(char *src)
+{
+	while (*src != '\0' && isspace((unsigned char) *src)) {
+		src++;
+	}
+
+	return src;
+}
+
+
+/*
+ * Copy a JSON string starting at the opening quote into dst.
+ * Returns the position after the closing quote, or NULL on error.
+ */
+
+static char *
+main_parse_string(char *src, char *dst, size_t len)
+{
+	size_t ofs = 0;
+	unsigned int code;
+	char chr;
+
+	if (*src++ != '"') {
+		return NULL;
+	}
+
+	while ((chr = *src++) != '"') {
+		if (chr == '\0') {
+			return NULL;
+		}
+		if (chr == '\\') {
+			switch ((chr = *src++)) {
+				case 'b': chr = '\b'; break;
+				case 'f': chr = '\f'; break;
+				case 'n': chr = '\n'; break;
+				case 'r': chr = '\r'; break;
+				case 't': chr = '\t'; break;
+				case 'u':
+					if (sscanf(src, "%4x", &code) != 1) {
+						return NULL;
+					}
+					chr = (code < 0x80) ? (char) code : '?';
+					src += 4;
+					break;
+				case '\0':
+					return NULL;
+				default:
+					break;	// covers \" \\ and \/
+			}
+		}
+		if (ofs < len - 1) {
+			dst[ofs++] = chr;
+		}
+	}
+	dst[ofs] = '\0';
+
+	return src;
+}
+
+
+/*
+ * Copy a bare JSON token (number, true, false, null) into dst.
+ */
+
+static char *
+main_parse_token(char *src, char *dst, size_t len)
+{
+	size_t ofs = 0;
+
+	while (*src != '\0' && strchr(",}] \t\r\n", *src) == NULL) {
+		if (ofs < len - 1) {
+			dst[ofs++] = *src;
+		}
+		src++;
+	}
+	dst[ofs] = '\0';
+
+	return ofs > 0 ? src : NULL;
+}
+
+
+/*
+ * Copy an array of strings like ["_http._tcp", "_ipp._tcp"] into dst
+ * as a comma separated list. Other scalars are skipped. Returns the
+ * position after the closing bracket, or NULL on error.
+ */
+
+static char *
+main_parse_array(char *src, char *dst, size_t len)
+{
+	char item[256];
+
+	*dst = '\0';
+	src = main_skip_space(src + 1);
+	if (*src == ']') {
+		return src + 1;
+	}
+
+	for (;;) {
+		if (*src == '"') {
+			if ((src = main_parse_string(src, item, sizeof(item))) == NULL) {
+				return NULL;
+			}
+			util_append(dst, len, "%s%s", *dst != '\0' ? "," : "", item);
+		} else if (*src != '[' && *src != '{' && (src = main_parse_token(src, item, sizeof(item))) != NULL) {
+			util_error(__func__, __LINE__, "only strings in a list, skip %s", item);
+		} else {
+			return NULL;
+		}
+
+		src = main_skip_space(src);
+		if (*src == ']') {
+			return src + 1;
+		}
+		if (*src++ != ',') {
+			return NULL;
+		}
+		src = main_skip_space(src);
+	}
+}
+
+
+/*
+ * The only request key this host knows is "types", a string or an
+ * array of strings; the request is walked as JSON like on Linux so
+ * that only the key itself matches. Firefox sends the request as a
+ * JSON string which contains the object.
+ */
+
+static void
+main_request_types(char *input, char *types, size_t len)
+{
+	char buffer[sizeof(my_input)], key[64], val[1024], *ptr;
+
+	ptr = main_skip_space(input);
+	if (*ptr == '"') {
+		if (main_parse_string(ptr, buffer, sizeof(buffer)) == NULL) {
+			util_error(__func__, __LINE__, "invalid request string '%s'", input);
+			return;
+		}
+	} else {
+		UTIL_STRCPY(buffer, ptr);
+	}
+
+	ptr = main_skip_space(buffer);
+	if (*ptr++ != '{') {
+		util_error(__func__, __LINE__, "request is not an object '%s'", buffer);
+		return;
+	}
+
+	for (;;) {
+		ptr = main_skip_space(ptr);
+		if (*ptr == '}') {
+			return;
+		}
+		if ((ptr = main_parse_string(ptr, key, sizeof(key))) == NULL) {
+			break;
+		}
+		ptr = main_skip_space(ptr);
+		if (*ptr++ != ':') {
+			break;
+		}
+		ptr = main_skip_space(ptr);
+		if (*ptr == '"') {
+			ptr = main_parse_string(ptr, val, sizeof(val));
+		} else if (*ptr == '[') {
+			ptr = main_parse_array(ptr, val, sizeof(val));
+		} else {
+			ptr = main_parse_token(ptr, val, sizeof(val));
+		}
+		if (ptr == NULL) {
+			break;
+		}
+
+		if (strcmp(key, "types") != 0) {
+			util_info("ignore request key '%s'", key);
+		} else if (*val != '\0') {
+			util_strcpy(types, val, len);
+			util_info("request types '%s'", types);
+		}
+
+		ptr = main_skip_space(ptr);
+		if (*ptr == ',') {
+			ptr++;
+		} else if (*ptr != '}') {
+			break;
+		}
+	}
+
+	util_error(__func__, __LINE__, "malformed request '%s'", buffer);
+}
+
+
 static void
 main_send_result(char *source, int readable, result_t *result)
 {
@@ -180,7 +379,7 @@ int
 main(int argc, char *argv[])
 {
 	int c, do_log, readable, do_inst, do_uninst;
-	char progname[FILENAME_MAX];
+	char progname[FILENAME_MAX], types[1024] = SERVICE_TYPES;
 	uint32_t size = sizeof(progname);
 
 	if (_NSGetExecutablePath(progname, &size) != 0) {
@@ -189,7 +388,7 @@ main(int argc, char *argv[])
 
 	do_log = readable = do_inst = do_uninst = 0;
 	for (;;) {
-		c = getopt_long(argc, argv, "h?ilruv", long_options, NULL);
+		c = getopt_long(argc, argv, "h?ilruvy:", long_options, NULL);
 		if (c < 0) {
 			break;
 		}
@@ -214,6 +413,9 @@ main(int argc, char *argv[])
 			case 'v':
 				util_inc_verbose();
 				break;
+			case 'y':
+				UTIL_STRCPY(types, optarg);
+				break;
 			default:
 				main_usage(argv[0], EXIT_FAILURE);
 				break;
@@ -236,9 +438,10 @@ main(int argc, char *argv[])
 
 	if (readable == 0) {
 		main_receive_input();
+		main_request_types(my_input, types, sizeof(types));
 	}
 
-	main_send_result("mDNSResponder (C, " VERSION ")", readable, dnssd_browse());
+	main_send_result("mDNSResponder (C, " VERSION ")", readable, dnssd_browse(types));
 	exit(EXIT_SUCCESS);
 }
 
@@ -30,6 +30,12 @@
 
 #include <time.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 
 static int   my_verbose = 0;
 static FILE *my_log_fp  = NULL;
@@ -150,17 +156,279 @@ util_strtrim(char *src, const char *trim)
 }
 
 
+/*
+ * Formats straight into the free part of dst, an escaped name or TXT
+ * string may be longer than any fixed scratch buffer
+ */
+
 char *
 util_append(char *dst, size_t len, char *fmt, ...)
 {
-	char tmp[FILENAME_MAX];
+	size_t siz;
 	va_list ap;
 
+	if (dst == NULL || len == 0 || (siz = strlen(dst)) >= len - 1) {
+		return dst;
+	}
+
 	va_start(ap, fmt);
-	vsnprintf(tmp, sizeof(tmp), fmt, ap);
+	vsnprintf(dst + siz, len - siz, fmt, ap);
 	va_end(ap);
 
-	return util_strcat(dst, tmp, len);
+	return dst;
+}
+
+
+/*
+ * JSON string escaping: most names and TXT strings need no escaping at
+ * all, so the vector code only searches for the next quote, backslash,
+ * control character or non-ASCII byte and everything in between is
+ * copied with memcpy(). Non-ASCII goes through the UTF-8 check below.
+ */
+
+static size_t
+util_json_span_scalar(const char *src, size_t len)
+{
+	size_t ofs;
+	unsigned char chr;
+
+	for (ofs = 0; ofs < len; ofs++) {
+		chr = (unsigned char) src[ofs];
+		if (chr < 0x20 || chr >= 0x80 || chr == '"' || chr == '\\') {
+			break;
+		}
+	}
+
+	return ofs;
+}
+
+
+#if defined(__SSE2__)
+
+static size_t
+util_json_span_sse2(const char *src, size_t len)
+{
+	const __m128i quote  = _mm_set1_epi8('"');
+	const __m128i bslash = _mm_set1_epi8('\\');
+	const __m128i ctrl   = _mm_set1_epi8(0x1f);
+	__m128i vec, hit;
+	size_t ofs;
+	int mask;
+
+	for (ofs = 0; ofs + 16 <= len; ofs += 16) {
+		vec = _mm_loadu_si128((const __m128i *) (src + ofs));
+		hit = _mm_or_si128(_mm_cmpeq_epi8(vec, quote), _mm_cmpeq_epi8(vec, bslash));
+		hit = _mm_or_si128(hit, _mm_cmpeq_epi8(_mm_min_epu8(vec, ctrl), vec));
+		if ((mask = _mm_movemask_epi8(hit) | _mm_movemask_epi8(vec)) != 0) {
+			return ofs + (size_t) __builtin_ctz((unsigned int) mask);
+		}
+	}
+
+	return ofs + util_json_span_scalar(src + ofs, len - ofs);
+}
+
+#endif
+
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+
+__attribute__((target("avx2")))
+static size_t
+util_json_span_avx2(const char *src, size_t len)
+{
+	const __m256i quote  = _mm256_set1_epi8('"');
+	const __m256i bslash = _mm256_set1_epi8('\\');
+	const __m256i ctrl   = _mm256_set1_epi8(0x1f);
+	__m256i vec, hit;
+	size_t ofs;
+	unsigned int mask;
+
+	for (ofs = 0; ofs + 32 <= len; ofs += 32) {
+		vec = _mm256_loadu_si256((const __m256i *) (src + ofs));
+		hit = _mm256_or_si256(_mm256_cmpeq_epi8(vec, quote), _mm256_cmpeq_epi8(vec, bslash));
+		hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(_mm256_min_epu8(vec, ctrl), vec));
+		if ((mask = (unsigned int) (_mm256_movemask_epi8(hit) | _mm256_movemask_epi8(vec))) != 0) {
+			return ofs + (size_t) __builtin_ctz(mask);
+		}
+	}
+
+	return ofs + util_json_span_scalar(src + ofs, len - ofs);
+}
+
+#endif
+
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+
+static size_t
+util_json_span_neon(const char *src, size_t len)
+{
+	const uint8x16_t quote  = vdupq_n_u8('"');
+	const uint8x16_t bslash = vdupq_n_u8('\\');
+	const uint8x16_t ctrl   = vdupq_n_u8(0x1f);
+	uint8x16_t vec, hit;
+	size_t ofs;
+
+	for (ofs = 0; ofs + 16 <= len; ofs += 16) {
+		vec = vld1q_u8((const uint8_t *) (src + ofs));
+		hit = vorrq_u8(vceqq_u8(vec, quote), vceqq_u8(vec, bslash));
+		hit = vorrq_u8(hit, vcleq_u8(vec, ctrl));
+		hit = vorrq_u8(hit, vcgeq_u8(vec, vdupq_n_u8(0x80)));
+		if (vmaxvq_u8(hit) != 0) {
+			break;	// the exact position is found by the scalar loop
+		}
+	}
+
+	return ofs + util_json_span_scalar(src + ofs, len - ofs);
+}
+
+#endif
+
+
+static size_t
+util_json_span(const char *src, size_t len)
+{
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+	static int have_avx2 = -1;
+
+	if (have_avx2 < 0) {
+		__builtin_cpu_init();
+		have_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+	}
+	if (have_avx2 && len >= 32) {
+		return util_json_span_avx2(src, len);
+	}
+#endif
+#if defined(__SSE2__)
+	return util_json_span_sse2(src, len);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	return util_json_span_neon(src, len);
+#else
+	return util_json_span_scalar(src, len);
+#endif
+}
+
+
+/*
+ * Length of the well-formed UTF-8 sequence at src (RFC 3629: no overlong
+ * forms, no surrogates, nothing above U+10FFFF), 0 if it is invalid
+ */
+
+static size_t
+util_utf8_length(const unsigned char *src, size_t len)
+{
+	unsigned char lo = 0x80, hi = 0xbf;
+	size_t num, idx;
+
+	if (src[0] >= 0xc2 && src[0] <= 0xdf) {
+		num = 2;
+	} else if (src[0] >= 0xe0 && src[0] <= 0xef) {
+		num = 3;
+		lo = (src[0] == 0xe0) ? 0xa0 : 0x80;
+		hi = (src[0] == 0xed) ? 0x9f : 0xbf;
+	} else if (src[0] >= 0xf0 && src[0] <= 0xf4) {
+		num = 4;
+		lo = (src[0] == 0xf0) ? 0x90 : 0x80;
+		hi = (src[0] == 0xf4) ? 0x8f : 0xbf;
+	} else {
+		return 0;
+	}
+	if (num > len || src[1] < lo || src[1] > hi) {
+		return 0;
+	}
+	for (idx = 2; idx < num; idx++) {
+		if (src[idx] < 0x80 || src[idx] > 0xbf) {
+			return 0;
+		}
+	}
+
+	return num;
+}
+
+
+/*
+ * Write src as JSON string contents (without the quotes) into dst.
+ * The output is truncated at a character boundary if dst is too small,
+ * a UTF-8 sequence is copied whole or not at all. Invalid UTF-8 (from a
+ * TXT record, say) becomes U+FFFD, the browser rejects the message else.
+ * Returns the number of bytes written (without the trailing NUL).
+ */
+
+size_t
+util_json_escape(char *dst, size_t len, const char *src)
+{
+	static const char hex[] = "0123456789abcdef";
+	size_t ofs, siz, run;
+	unsigned char chr;
+	char esc[8];
+
+	if (dst == NULL || len == 0) {
+		return 0;
+	}
+	if (src == NULL) {
+		*dst = '\0';
+		return 0;
+	}
+
+	for (ofs = 0, siz = strlen(src); siz > 0; src++, siz--) {
+		run = util_json_span(src, siz);
+		if (run > len - ofs - 1) {
+			run = len - ofs - 1;
+		}
+		memcpy(dst + ofs, src, run);
+		ofs += run;
+		src += run;
+		siz -= run;
+		if (siz == 0 || ofs == len - 1) {
+			break;
+		}
+
+		chr = (unsigned char) *src;
+		if (chr >= 0x80) {
+			if ((run = util_utf8_length((const unsigned char *) src, siz)) == 0) {
+				if (ofs + 6 > len - 1) {
+					break;
+				}
+				memcpy(dst + ofs, "\\ufffd", 6);
+				ofs += 6;
+				continue;
+			}
+			if (ofs + run > len - 1) {
+				break;
+			}
+			memcpy(dst + ofs, src, run);
+			ofs += run;
+			src += run - 1;
+			siz -= run - 1;
+			continue;
+		}
+
+		esc[0] = '\\';
+		esc[2] = '\0';
+		switch (chr) {
+			case '"':  esc[1] = '"';  break;
+			case '\\': esc[1] = '\\'; break;
+			case '\b': esc[1] = 'b';  break;
+			case '\f': esc[1] = 'f';  break;
+			case '\n': esc[1] = 'n';  break;
+			case '\r': esc[1] = 'r';  break;
+			case '\t': esc[1] = 't';  break;
+			default:
+				memcpy(esc + 1, "u00", 3);
+				esc[4] = hex[chr >> 4];
+				esc[5] = hex[chr & 0x0f];
+				esc[6] = '\0';
+				break;
+		}
+		if (ofs + strlen(esc) > len - 1) {
+			break;
+		}
+		memcpy(dst + ofs, esc, strlen(esc));
+		ofs += strlen(esc);
+	}
+	dst[ofs] = '\0';
+
+	return ofs;
 }
 
 
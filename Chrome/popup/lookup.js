@@ -11,8 +11,30 @@ var cancel = document.getElementById("cancel");
 cancel.textContent = chrome.i18n.getMessage("htmlCancel");
 cancel.onclick = function() { window.close(); };
 
-document.addEventListener('DOMContentLoaded', function () {
-  chrome.runtime.sendNativeMessage('com.railduino.zeroconf_lookup', { cmd: "Lookup" }, function(response) {
+// Big result lists come in several frames from one lookup, all on the
+// same port. The "next" token of a frame only matters if the port breaks
+// before the last one, then it resumes after the entries already shown.
+function lookup(token) {
+  var request = { cmd: "Lookup", compact: true };
+  var first = !token;
+  var resume = null;
+  var port = chrome.runtime.connectNative('com.railduino.zeroconf_lookup');
+
+  if (token) {
+    request.continue = token;
+  }
+
+  port.onDisconnect.addListener(function() {
+    if (resume) {
+      lookup(resume);
+    } else if (first) {
+      document.getElementById("waiting").textContent = chrome.i18n.getMessage("htmlError");
+      document.getElementById("message").textContent = chrome.i18n.getMessage("htmlNoServer");
+      document.getElementById("spinner").style.display = "none";
+    }
+  });
+
+  port.onMessage.addListener(function(response) {
     if (typeof response !== 'object') {
       document.getElementById("waiting").textContent = chrome.i18n.getMessage("htmlError");
       document.getElementById("message").textContent = chrome.i18n.getMessage("htmlNoServer");
@@ -25,7 +47,9 @@ document.addEventListener('DOMContentLoaded', function () {
     document.getElementById("source").textContent = chrome.i18n.getMessage("htmlSource") + response.source;
 
     var server_list = document.getElementById("server_list");
-    server_list.textContent = "";
+    if (first) {
+      server_list.textContent = "";
+    }
 
     if (response.result.length > 0) {
       for (i in response.result) {
@@ -55,7 +79,7 @@ document.addEventListener('DOMContentLoaded', function () {
         hr = document.createElement('hr');
         server_list.appendChild(hr);
       }
-    } else {
+    } else if (first) {
       div = document.createElement('div');
       div.textContent = chrome.i18n.getMessage("htmlNoServer");
       server_list.appendChild(div);
@@ -63,18 +87,32 @@ document.addEventListener('DOMContentLoaded', function () {
       server_list.appendChild(hr);
     }
 
-    document.addEventListener("click", (e) => {
-      if (e.target.classList.contains("server")) {
-        chrome.tabs.query({active: true, currentWindow: true}, function(tabs) {
-          chrome.tabs.update(tabs[0].id, {
-            active: true,
-            url: e.target.href
+    if (first) {
+      document.addEventListener("click", (e) => {
+        if (e.target.classList.contains("server")) {
+          chrome.tabs.query({active: true, currentWindow: true}, function(tabs) {
+            chrome.tabs.update(tabs[0].id, {
+              active: true,
+              url: e.target.href
+            });
+            window.close();
           });
-          window.close();
-        });
-      }
-      e.preventDefault();
-    }, false);
+        }
+        e.preventDefault();
+      }, false);
+    }
+
+    first = false;
+    resume = response.next || null;
+    if (!resume) {
+      port.disconnect();
+    }
   });
+
+  port.postMessage(request);
+}
+
+document.addEventListener('DOMContentLoaded', function () {
+  lookup(null);
 });
 
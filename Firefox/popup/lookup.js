@@ -13,14 +13,47 @@ function onError(error) {
   console.log(err_msg);
 }
 
+// Big result lists come in several frames from one lookup, all on the
+// same port. The "next" token of a frame only matters if the port breaks
+// before the last one, then it resumes after the entries already shown.
+var continued = false;
+var port = null;
+var resume = null;
+
+function lookup(token) {
+  var request = { cmd: "Lookup", compact: true };
+
+  if (token) {
+    request.continue = token;
+  }
+  continued = Boolean(token);
+  resume = null;
+
+  port = browser.runtime.connectNative("com.railduino.zeroconf_lookup");
+  port.onMessage.addListener(onResponse);
+  port.onDisconnect.addListener(onDisconnect);
+  port.postMessage(JSON.stringify(request));
+}
+
+function onDisconnect(p) {
+  if (resume) {
+    lookup(resume);
+  } else if (!continued) {
+    onError(p.error ? p.error.message : browser.i18n.getMessage("htmlNoServer"));
+  }
+}
+
 function onResponse(response) {
   var str = JSON.stringify(response, null, 2);
   var i, server, a, div, hr, br, line;
+  var first = !continued;
 
   document.getElementById("source").textContent = browser.i18n.getMessage("htmlSource") + response.source;
 
   var server_list = document.getElementById("server_list");
-  server_list.textContent = "";
+  if (first) {
+    server_list.textContent = "";
+  }
 
   if (response.result.length > 0) {
     for (i in response.result) {
@@ -50,7 +83,7 @@ function onResponse(response) {
       hr = document.createElement('hr');
       server_list.appendChild(hr);
     }
-  } else {
+  } else if (first) {
     div = document.createElement('div');
     div.textContent = chrome.i18n.getMessage("htmlNoServer");;
     server_list.appendChild(div);
@@ -58,19 +91,27 @@ function onResponse(response) {
     server_list.appendChild(hr);
   }
 
-  document.addEventListener("click", (e) => {
-    if (e.target.classList.contains("server")) {
-      var tab = browser.tabs.query({active: true, currentWindow: true});
-      tab.then((tabs) => {
-        browser.tabs.update(tabs[0].id, {
-          active: true,
-          url: e.target.href
+  if (first) {
+    document.addEventListener("click", (e) => {
+      if (e.target.classList.contains("server")) {
+        var tab = browser.tabs.query({active: true, currentWindow: true});
+        tab.then((tabs) => {
+          browser.tabs.update(tabs[0].id, {
+            active: true,
+            url: e.target.href
+          });
+          window.close();
         });
-        window.close();
-      });
-    }
-    e.preventDefault();
-  }, false);
+      }
+      e.preventDefault();
+    }, false);
+  }
+
+  continued = true;
+  resume = response.next || null;
+  if (!resume) {
+    port.disconnect();
+  }
 }
 
 document.getElementById("header").textContent = browser.i18n.getMessage("htmlHeader");
@@ -80,6 +121,5 @@ var cancel = document.getElementById("cancel");
 cancel.textContent = browser.i18n.getMessage("htmlCancel");
 cancel.onclick = function() { window.close(); };
 
-var sending = browser.runtime.sendNativeMessage("com.railduino.zeroconf_lookup", '{"cmd":"Lookup"}');
-sending.then(onResponse, onError);
+lookup(null);
 
@@ -30,90 +30,289 @@
 
 #include <avahi-client/client.h>
 #include <avahi-client/lookup.h>
-#include <avahi-common/simple-watch.h>
+#include <avahi-common/watch.h>
 #include <avahi-common/malloc.h>
 #include <avahi-common/error.h>
 
+#include <dlfcn.h>
+#include <net/if.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/time.h>
 
-static result_t *my_results = NULL;
 
-static AvahiSimplePoll     *my_poll    = NULL;
 static AvahiClient         *my_client  = NULL;
-static AvahiServiceBrowser *my_browser = NULL;
+#define AVAHI_IFACES	32
+
+
+/*
+ * libavahi-client is only loaded when the Avahi backend runs, so
+ * force=query starts without the Avahi and D-Bus libraries and the
+ * binary still works where Avahi isn't installed. The headers just
+ * provide the types, every call goes through a pointer from dlsym().
+ */
+
+#define AVAHI_LIBRARY	"libavahi-client.so.3"
+
+#define AVAHI_SYMBOLS \
+	AVAHI_SYMBOL(avahi_client_new) \
+	AVAHI_SYMBOL(avahi_client_free) \
+	AVAHI_SYMBOL(avahi_client_errno) \
+	AVAHI_SYMBOL(avahi_strerror) \
+	AVAHI_SYMBOL(avahi_address_snprint) \
+	AVAHI_SYMBOL(avahi_service_browser_new) \
+	AVAHI_SYMBOL(avahi_service_browser_free) \
+	AVAHI_SYMBOL(avahi_service_browser_get_client) \
+	AVAHI_SYMBOL(avahi_service_type_browser_new) \
+	AVAHI_SYMBOL(avahi_service_type_browser_free) \
+	AVAHI_SYMBOL(avahi_service_type_browser_get_client) \
+	AVAHI_SYMBOL(avahi_service_resolver_new) \
+	AVAHI_SYMBOL(avahi_service_resolver_free) \
+	AVAHI_SYMBOL(avahi_service_resolver_get_client) \
+	AVAHI_SYMBOL(avahi_host_name_resolver_new) \
+	AVAHI_SYMBOL(avahi_host_name_resolver_free) \
+	AVAHI_SYMBOL(avahi_host_name_resolver_get_client)
+
+#define AVAHI_SYMBOL(name)	static __typeof__(name) *my_##name = NULL;
+AVAHI_SYMBOLS
+#undef AVAHI_SYMBOL
+
+static void *my_library = NULL;
+
+
+/*
+ * One browser per service type and allowed interface (AVAHI_IF_UNSPEC
+ * if the interfaces can't be listed), all on the one client; the loop
+ * ends once all of them are done and every resolver they started has
+ * reported, or at the deadline. Types uses a type browser per interface
+ * in the same slots instead.
+ */
+
+#define AVAHI_BROWSERS	256
+
+static AvahiServiceBrowser *my_browsers[AVAHI_BROWSERS];
+static AvahiServiceTypeBrowser *my_type_browsers[AVAHI_BROWSERS];
+static int                  my_browser_ended[AVAHI_BROWSERS];
+static int                  my_browser_cnt  = 0;
+static int                  my_browser_done = 0;
+static int                  my_browser_new[AVAHI_BROWSERS];	// NEW events per slot
+static int                  my_browser_cached[AVAHI_BROWSERS];	// cache exhausted
+static int                  my_resolving    = 0;	// resolvers in flight
+static int                  my_race         = 0;	// query sockets share the loop
+
+static iface_t my_ifaces[AVAHI_IFACES];
+static int     my_iface_cnt = -1;
+
+
+/*
+ * The same instance shows up once per (interface, protocol) pair, but
+ * it is resolved only once: the first NEW event for (name, type, domain)
+ * starts the resolver, the others are just counted. Every pair is kept,
+ * if a resolver fails the next one gets a try.
+ */
+
+#define AVAHI_SERVICES	256
+#define AVAHI_SIGHTINGS	8
+
+typedef struct {
+	char		name[256];
+	char		type[64];
+	char		domain[64];
+	AvahiIfIndex	ifs[AVAHI_SIGHTINGS];
+	AvahiProtocol	protos[AVAHI_SIGHTINGS];
+	int		sightings;
+	int		tried;		// sightings a resolver was started for
+	int		pending;	// resolver in flight
+	int		resolved;
+} service_t;
+
+static service_t my_services[AVAHI_SERVICES];
+static int       my_service_cnt = 0;
 
 
 static void
 avahi_cleanup(void)
 {
-	result_t *tmp;
-
-	if (my_browser != NULL) {
-		avahi_service_browser_free(my_browser);
-		my_browser = NULL;
+	while (my_browser_cnt > 0) {
+		if (my_browsers[--my_browser_cnt] != NULL) {
+			my_avahi_service_browser_free(my_browsers[my_browser_cnt]);
+		}
+		if (my_type_browsers[my_browser_cnt] != NULL) {
+			my_avahi_service_type_browser_free(my_type_browsers[my_browser_cnt]);
+		}
 	}
 
 	if (my_client != NULL) {
-		avahi_client_free(my_client);
+		my_avahi_client_free(my_client);
 		my_client = NULL;
 	}
+}
+
+
+static char *
+avahi_iface_name(AvahiIfIndex interface, char *name)
+{
+	if (interface < 0 || if_indextoname((unsigned int) interface, name) == NULL) {
+		*name = '\0';
+	}
+
+	return name;
+}
+
+
+static int
+avahi_iface_allowed(AvahiIfIndex interface)
+{
+	int idx;
+
+	if (my_iface_cnt < 0 || interface < 0) {
+		return 1;	// no policy possible
+	}
+
+	for (idx = 0; idx < my_iface_cnt; idx++) {
+		if ((AvahiIfIndex) my_ifaces[idx].index == interface) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ * Remember the instance and where it was seen. Returns its entry (and
+ * *known = 1 if it was seen before), NULL if the table is full.
+ */
+
+static service_t *
+avahi_service_seen(const char *name, const char *type, const char *domain,
+		AvahiIfIndex interface, AvahiProtocol protocol, int *known)
+{
+	service_t *srv;
+	int idx;
+
+	*known = 0;
+	for (idx = 0, srv = NULL; idx < my_service_cnt; idx++) {
+		if (strcmp(my_services[idx].name, name) == 0 && strcmp(my_services[idx].type, type) == 0 &&
+		    strcasecmp(my_services[idx].domain, domain) == 0) {
+			srv = &my_services[idx];
+			*known = 1;
+			break;
+		}
+	}
+	if (srv == NULL) {
+		if (my_service_cnt == AVAHI_SERVICES) {
+			return NULL;	// too many to remember, resolve them all
+		}
+		srv = &my_services[my_service_cnt++];
+		UTIL_STRCPY(srv->name, name);
+		UTIL_STRCPY(srv->type, type);
+		UTIL_STRCPY(srv->domain, domain);
+	}
 
-	if (my_poll != NULL) {
-		avahi_simple_poll_free(my_poll);
-		my_poll = NULL;
+	if (srv->sightings < AVAHI_SIGHTINGS) {
+		srv->ifs[srv->sightings]    = interface;
+		srv->protos[srv->sightings] = protocol;
+		srv->sightings++;
 	}
 
-	while (my_results != NULL) {
-		tmp = my_results->next;
-		util_free(my_results->text);
-		util_free(my_results);
-		my_results = tmp;
+	return srv;
+}
+
+
+/*
+ * Only ask for the address family the interface can reach, with both
+ * (or no policy) any address will do
+ */
+
+static AvahiProtocol
+avahi_address_protocol(AvahiIfIndex interface)
+{
+	int idx;
+
+	for (idx = 0; idx < my_iface_cnt; idx++) {
+		if ((AvahiIfIndex) my_ifaces[idx].index != interface) {
+			continue;
+		}
+		if (my_ifaces[idx].addr.s_addr == 0) {
+			return AVAHI_PROTO_INET6;
+		}
+		if (my_ifaces[idx].inet6 == 0) {
+			return AVAHI_PROTO_INET;
+		}
+		break;
 	}
+
+	return AVAHI_PROTO_UNSPEC;
+}
+
+
+static AvahiLookupFlags
+avahi_lookup_flags(void)
+{
+	return request_need_txt() ? 0 : AVAHI_LOOKUP_NO_TXT;
 }
 
 
+static int avahi_resolve_next(service_t *srv);
+
+
 static void
 avahi_resolve_callback(AvahiServiceResolver *r,
-		AVAHI_GCC_UNUSED AvahiIfIndex interface,
+		AvahiIfIndex interface,
 		AvahiProtocol protocol,
 		AvahiResolverEvent event,
 		const char *name,
-		AVAHI_GCC_UNUSED const char *type,
+		const char *type,
 		AVAHI_GCC_UNUSED const char *domain,
 		const char *host_name,
 		const AvahiAddress *address,
 		uint16_t port,
 		AvahiStringList *txt,
-		AVAHI_GCC_UNUSED AvahiLookupResultFlags flags,
-		AVAHI_GCC_UNUSED void *userdata)
+		AvahiLookupResultFlags flags,
+		void *userdata)
 {
-	char answer[4096], tmp_adr[AVAHI_ADDRESS_STR_MAX], url[1024];
+	char tmp_adr[AVAHI_ADDRESS_STR_MAX], ifname[IF_NAMESIZE];
+	service_t *srv = userdata;	// NULL for Resolve
 	txt_t *head, *tail, *ptr;
 	AvahiStringList *run;
-	result_t *result;
+	result_t *res;
+
+	trace_end("avahi", "resolve", r, event == AVAHI_RESOLVER_FOUND ? "found" : "failure");
+	my_resolving--;
+	if (srv != NULL) {
+		srv->pending  = 0;
+		srv->resolved = (event == AVAHI_RESOLVER_FOUND);
+	}
 
 	if (event == AVAHI_RESOLVER_FAILURE) {
+		stats_inc(STATS_RESOLVER_FAILURES);
 		util_error(__func__, __LINE__, "avahi_resolve_callback() error %s",
-				avahi_strerror(avahi_client_errno(avahi_service_resolver_get_client(r))));
-		avahi_service_resolver_free(r);
+				my_avahi_strerror(my_avahi_client_errno(my_avahi_service_resolver_get_client(r))));
+		my_avahi_service_resolver_free(r);
+		if (srv != NULL && avahi_resolve_next(srv) == 0) {
+			util_info("Avahi gave up on %s after %d tries", srv->name, srv->tried);
+		}
 		return;
 	}
 	if (event != AVAHI_RESOLVER_FOUND) {
 		util_debug(3, "avahi_resolve_callback() unknown event %d", event);
-		avahi_service_resolver_free(r);
+		my_avahi_service_resolver_free(r);
 		return;
 	}
 	util_debug(3, "avahi_resolve_callback() event: AVAHI_RESOLVER_FOUND %s", host_name);
+	timing_answer();
 
-	if (protocol == AVAHI_PROTO_INET6) {
-		util_debug(3, "avahi_resolve_callback() ignore IPv6");
-		avahi_service_resolver_free(r);
+	if (avahi_iface_allowed(interface) == 0) {
+		util_debug(1, "Avahi skip %s on excluded interface %d", name, interface);
+		my_avahi_service_resolver_free(r);
 		return;
 	}
 
-	util_debug(3, "avahi_resolve_callback() address-in %s", host_name);
-	avahi_address_snprint(tmp_adr, sizeof(tmp_adr), address);
-	snprintf(url, sizeof(url), "http://%s:%u/", tmp_adr, port);
-	util_debug(3, "avahi_resolve_callback() address-out %s", url);
+	util_debug(3, "avahi_resolve_callback() address-in %s (%s)", host_name,
+			(protocol == AVAHI_PROTO_INET6) ? "IPv6" : "IPv4");
+	my_avahi_address_snprint(tmp_adr, sizeof(tmp_adr), address);
+	trace_instant(trace_responder(tmp_adr), "avahi", "resolved", name);
 
 	for (run = txt, head = tail = NULL; run != NULL; run = run->next) {
 		if (run->size >= sizeof(ptr->text)) {
@@ -127,54 +326,236 @@ avahi_resolve_callback(AvahiServiceResolver *r,
 			tail = (tail->next = ptr);
 		}
 	}
-	if (port == 3689) {
-		ptr = util_malloc(sizeof(txt_t));
-		UTIL_STRCPY(ptr->text, "DAAP (iTunes) Server");
-		ptr->next = head;
-		head = ptr;
+	if (request_match(name, head, port) == 0) {
+		util_debug(1, "Avahi filtered: %s", name);
+		while (head != NULL) {
+			ptr = head->next;
+			util_free(head);
+			head = ptr;
+		}
+		my_avahi_service_resolver_free(r);
+		return;
 	}
 
-	UTIL_STRCPY(answer, "    {\n");
-	util_append(answer, sizeof(answer), "      \"name\": \"%s\",\n",   name);
+	my_avahi_service_resolver_free(r);
 
-	util_append(answer, sizeof(answer), "      \"txt\": [ ");
-	for (ptr = head; ptr != NULL; ptr = ptr->next) {
-		util_append(answer, sizeof(answer), "\"%s\"", ptr->text);
-		if (ptr->next != NULL) {
-			util_append(answer, sizeof(answer), ", ");
-		} else {
-			util_append(answer, sizeof(answer), " ");
+	res = result_new(name, type, host_name, port, tmp_adr, avahi_iface_name(interface, ifname), head);
+	res->cached = (flags & AVAHI_LOOKUP_RESULT_CACHED) != 0;
+	res->source = RESULT_AVAHI;
+	if (result_add(res) == 0) {
+		util_debug(1, "Avahi duplicate: %s", name);
+		return;
+	}
+	util_info("Avahi found %s for %s", res->url, name);
+
+	if (request_satisfied(result_get_count())) {
+		util_info("Avahi got %d matching results, stop browsing", result_get_count());
+		loop_quit();
+	}
+}
+
+
+/*
+ * Start a resolver for the next place the instance was seen, one at a
+ * time. Returns 0 if there is none left.
+ */
+
+static int
+avahi_resolve_next(service_t *srv)
+{
+	AvahiServiceResolver *resolver;
+	AvahiIfIndex interface;
+	AvahiProtocol protocol;
+
+	while (srv->tried < srv->sightings) {
+		interface = srv->ifs[srv->tried];
+		protocol  = srv->protos[srv->tried++];
+		resolver  = my_avahi_service_resolver_new(my_client, interface, protocol, srv->name, srv->type, srv->domain,
+				avahi_address_protocol(interface), avahi_lookup_flags(), avahi_resolve_callback, srv);
+		if (resolver == NULL) {
+			util_error(__func__, __LINE__, "avahi_service_resolver_new() error for %s: %s",
+					srv->name, my_avahi_strerror(my_avahi_client_errno(my_client)));
+			continue;
 		}
+		if (srv->tried > 1) {
+			util_info("Avahi retry %s on interface %d", srv->name, interface);
+		}
+		trace_begin("avahi", "resolve", resolver, srv->name);
+		my_resolving++;
+		srv->pending = 1;
+		return 1;
+	}
+
+	return 0;
+}
+
+
+static void
+avahi_host_callback(AvahiHostNameResolver *r,
+		AvahiIfIndex interface,
+		AvahiProtocol protocol,
+		AvahiResolverEvent event,
+		const char *host_name,
+		const AvahiAddress *address,
+		AVAHI_GCC_UNUSED AvahiLookupResultFlags flags,
+		AVAHI_GCC_UNUSED void *userdata)
+{
+	char tmp_adr[AVAHI_ADDRESS_STR_MAX], url[1024], ifname[IF_NAMESIZE];
+	result_t *res;
+	int port;
+
+	trace_end("avahi", "resolve-host", r, event == AVAHI_RESOLVER_FOUND ? "found" : "failure");
+	my_resolving--;
+
+	if (event != AVAHI_RESOLVER_FOUND) {
+		stats_inc(STATS_RESOLVER_FAILURES);
+		util_error(__func__, __LINE__, "avahi_host_callback() error %s",
+				my_avahi_strerror(my_avahi_client_errno(my_avahi_host_name_resolver_get_client(r))));
+		my_avahi_host_name_resolver_free(r);
+		loop_quit();
+		return;
+	}
+	util_debug(3, "avahi_host_callback() event: AVAHI_RESOLVER_FOUND %s", host_name);
+	timing_answer();
+
+	if (avahi_iface_allowed(interface) == 0) {
+		util_debug(1, "Avahi skip %s on excluded interface %d", host_name, interface);
+		my_avahi_host_name_resolver_free(r);
+		loop_quit();
+		return;
 	}
-	util_append(answer, sizeof(answer), "],\n");
 
-	util_append(answer, sizeof(answer), "      \"target\": \"%s\",\n", host_name);
-	util_append(answer, sizeof(answer), "      \"port\": %u,\n",       port);
-	util_append(answer, sizeof(answer), "      \"a\": \"%s\",\n",      tmp_adr);
-	util_append(answer, sizeof(answer), "      \"url\": \"%s\"\n",     url);
-	UTIL_STRCAT(answer, "    }");
+	if ((port = request_get_host_port()) == 0) {
+		port = 80;
+	}
+	my_avahi_address_snprint(tmp_adr, sizeof(tmp_adr), address);
+	snprintf(url, sizeof(url), "http://%s%s%s:%u/", (protocol == AVAHI_PROTO_INET6) ? "[" : "",
+			tmp_adr, (protocol == AVAHI_PROTO_INET6) ? "]" : "", port);
+	trace_instant(trace_responder(tmp_adr), "avahi", "resolved", host_name);
+
+	my_avahi_host_name_resolver_free(r);
+
+	res = result_new(host_name, NULL, host_name, port, tmp_adr, avahi_iface_name(interface, ifname), NULL);
+	res->source = RESULT_AVAHI;
+	result_add(res);
 
-	while (head != NULL) {
-		ptr = head->next;
-		util_free(head);
-		head = ptr;
+	util_info("Avahi found %s for %s", url, host_name);
+	loop_quit();
+}
+
+
+/*
+ * A browser counts as done once, whether by ALL_FOR_NOW or from the cache
+ */
+
+static void
+avahi_browser_end(int idx)
+{
+	if (my_browser_ended[idx] == 0) {
+		my_browser_ended[idx] = 1;
+		my_browser_done++;
 	}
+}
 
-	avahi_service_resolver_free(r);
 
-	for (result = my_results; result != NULL; result = result->next) {
-		if (strcmp(result->text, answer) == 0) {
-			util_debug(1, "Avahi duplicate: %s", name);
-			return;		// duplicate entry
+static int
+avahi_browser_slot(AvahiServiceBrowser *b)
+{
+	int idx;
+
+	for (idx = 0; idx < my_browser_cnt; idx++) {
+		if (my_browsers[idx] == b) {
+			return idx;
 		}
 	}
 
-	result = util_malloc(sizeof(result_t));
-	result->next = my_results;
-	result->text = util_strdup(answer);
-	my_results = result;
+	return -1;
+}
 
-	util_info("Avahi found %s for %s", url, name);
+
+/*
+ * The daemon's cache is usually warm, then there is no need to wait
+ * for the network round (unless the caller wants fresh data). But one
+ * browser's cache says nothing about another interface or type, so all
+ * of them end only once every cache is exhausted and one had answers.
+ */
+
+static void
+avahi_browser_cached(int idx)
+{
+	int run, found;
+
+	my_browser_cached[idx] = 1;
+	if (request_get_fresh()) {
+		return;
+	}
+
+	for (run = 0, found = 0; run < my_browser_cnt; run++) {
+		if (my_browser_cached[run] == 0 && my_browser_ended[run] == 0) {
+			return;
+		}
+		found += my_browser_new[run];
+	}
+	if (found == 0) {
+		return;
+	}
+
+	util_debug(3, "all %d browser caches exhausted, %d answers", my_browser_cnt, found);
+	for (run = 0; run < my_browser_cnt; run++) {
+		avahi_browser_end(run);
+	}
+}
+
+
+/*
+ * Types: every service type the daemon knows of, the userdata is the slot
+ */
+
+static void
+avahi_type_callback(AvahiServiceTypeBrowser *b,
+		AvahiIfIndex interface,
+		AvahiProtocol protocol,
+		AvahiBrowserEvent event,
+		const char *type,
+		AVAHI_GCC_UNUSED const char *domain,
+		AVAHI_GCC_UNUSED AvahiLookupResultFlags flags,
+		void *userdata)
+{
+	int idx = (int) (intptr_t) userdata;
+
+	if (event == AVAHI_BROWSER_FAILURE) {
+		trace_instant(TRACE_LANE_AVAHI, "avahi", "types failure", NULL);
+		util_error(__func__, __LINE__, "avahi_type_callback() error %s",
+				my_avahi_strerror(my_avahi_client_errno(my_avahi_service_type_browser_get_client(b))));
+		loop_quit();
+		return;
+	}
+
+	if (event == AVAHI_BROWSER_NEW) {
+		timing_answer();
+		my_browser_new[idx]++;
+		trace_instant(TRACE_LANE_AVAHI, "avahi", "types new", type);
+		if (result_add_type(type) == 1) {
+			util_info("Avahi found service type %s", type);
+		} else {
+			util_debug(3, "avahi_type_callback() %s again (if %d, proto %d)", type, interface, protocol);
+		}
+		return;
+	}
+
+	if (event == AVAHI_BROWSER_ALL_FOR_NOW) {
+		trace_instant(TRACE_LANE_AVAHI, "avahi", "types all-for-now", NULL);
+		util_debug(3, "avahi_type_callback() event: AVAHI_BROWSER_ALL_FOR_NOW");
+		avahi_browser_end(idx);
+		return;
+	}
+
+	if (event == AVAHI_BROWSER_CACHE_EXHAUSTED) {
+		util_debug(3, "avahi_type_callback() event: AVAHI_BROWSER_CACHE_EXHAUSTED (%d so far)", my_browser_new[idx]);
+		avahi_browser_cached(idx);
+	} else {
+		util_debug(3, "avahi_type_callback() event: %d", (int) event);
+	}
 }
 
 
@@ -190,28 +571,67 @@ avahi_browse_callback(AvahiServiceBrowser *b,
 		void *userdata)
 {
 	AvahiClient *c = userdata;
+	AvahiServiceResolver *resolver;
+	service_t *srv;
+	int idx = avahi_browser_slot(b), known;
+
+	if (idx < 0) {
+		return;		// not (yet) in the table
+	}
 
 	if (event == AVAHI_BROWSER_FAILURE) {
+		trace_instant(TRACE_LANE_AVAHI, "avahi", "browse failure", NULL);
 		util_error(__func__, __LINE__, "avahi_browse_callback() error %s",
-				avahi_strerror(avahi_client_errno(avahi_service_browser_get_client(b))));
-		avahi_simple_poll_quit(my_poll);
+				my_avahi_strerror(my_avahi_client_errno(my_avahi_service_browser_get_client(b))));
+		loop_quit();
 		return;
 	}
 
 	if (event == AVAHI_BROWSER_NEW) {
-		if (avahi_service_resolver_new(c, interface, protocol, name, type, domain,
-				AVAHI_PROTO_UNSPEC, 0, avahi_resolve_callback, c) == NULL) {
+		timing_answer();
+		my_browser_new[idx]++;
+		trace_instant(TRACE_LANE_AVAHI, "avahi", "browse new", name);
+		if (request_match_name(name) == 0) {
+			util_debug(3, "avahi_browse_callback() skip %s", name);
+			return;
+		}
+		srv = avahi_service_seen(name, type, domain, interface, protocol, &known);
+		if (srv != NULL) {
+			if (known == 0 || (srv->pending == 0 && srv->resolved == 0)) {
+				avahi_resolve_next(srv);	// new, or the earlier tries failed
+			} else {
+				util_debug(3, "avahi_browse_callback() %s already resolving (if %d, proto %d)",
+						name, interface, protocol);
+				stats_inc(STATS_COALESCED);
+			}
+			return;
+		}
+		resolver = my_avahi_service_resolver_new(c, interface, protocol, name, type, domain,
+				avahi_address_protocol(interface), avahi_lookup_flags(), avahi_resolve_callback, NULL);
+		if (resolver == NULL) {
 			util_error(__func__, __LINE__, "avahi_browse_callback() error for %s: %s",
-					name, avahi_strerror(avahi_client_errno(c)));
+					name, my_avahi_strerror(my_avahi_client_errno(c)));
+		} else {
+			trace_begin("avahi", "resolve", resolver, name);
+			my_resolving++;
 		}
 		util_debug(3, "avahi_browse_callback() event: AVAHI_BROWSER_NEW");
 		return;
 	}
 
 	if (event == AVAHI_BROWSER_ALL_FOR_NOW) {
+		trace_instant(TRACE_LANE_AVAHI, "avahi", "browse all-for-now", NULL);
 		util_debug(3, "avahi_browse_callback() event: AVAHI_BROWSER_ALL_FOR_NOW");
-		avahi_simple_poll_quit(my_poll);
+		avahi_browser_end(idx);	// avahi_run() waits for the resolvers
+		return;
+	}
+
+	if (event == AVAHI_BROWSER_CACHE_EXHAUSTED) {
+		trace_instant(TRACE_LANE_AVAHI, "avahi", "browse cache-exhausted", NULL);
+		util_debug(3, "avahi_browse_callback() event: AVAHI_BROWSER_CACHE_EXHAUSTED (%d so far)", my_browser_new[idx]);
+		avahi_browser_cached(idx);
 	} else {
+		trace_instant(TRACE_LANE_AVAHI, "avahi", "browse event", name);
 		util_debug(3, "avahi_browse_callback() event: %d", (int) event);
 	}
 }
@@ -224,46 +644,424 @@ avahi_client_callback(AvahiClient *c,
 {
 	if (state == AVAHI_CLIENT_FAILURE) {
 		util_error(__func__, __LINE__, "avahi_client_callback() error %s",
-				avahi_strerror(avahi_client_errno(c)));
-		avahi_simple_poll_quit(my_poll);
+				my_avahi_strerror(my_avahi_client_errno(c)));
+		loop_quit();
 	}
 
 	util_debug(3, "avahi_client_callback() state: %d", (int) state);
 }
 
 
-result_t *
-avahi_browse(void)
+/*
+ * AvahiPoll on top of loop.c, so the client shares the one event loop
+ * with everything else. Avahi passes absolute gettimeofday() times,
+ * they are converted to the monotonic loop clock.
+ */
+
+struct AvahiWatch {
+	loop_watch_t		*watch;
+	AvahiWatchEvent		happened;	// for watch_get_events()
+	AvahiWatchCallback	callback;
+	void			*userdata;
+};
+
+
+struct AvahiTimeout {
+	loop_timer_t		*timer;
+	AvahiTimeoutCallback	callback;
+	void			*userdata;
+};
+
+
+static unsigned int
+avahi_to_epoll(AvahiWatchEvent event)
 {
-	int error;
+	return ((event & AVAHI_WATCH_IN) ? EPOLLIN : 0) | ((event & AVAHI_WATCH_OUT) ? EPOLLOUT : 0);
+}
 
-	util_info("calling Avahi browser");
-	atexit(avahi_cleanup);
 
-	my_poll = avahi_simple_poll_new();
-	if (my_poll == NULL) {
-		util_error(__func__, __LINE__, "avahi_simple_poll_new() failed");
+static AvahiWatchEvent
+avahi_from_epoll(unsigned int events)
+{
+	return (AvahiWatchEvent) (((events & EPOLLIN)  ? AVAHI_WATCH_IN  : 0) |
+				  ((events & EPOLLOUT) ? AVAHI_WATCH_OUT : 0) |
+				  ((events & EPOLLERR) ? AVAHI_WATCH_ERR : 0) |
+				  ((events & EPOLLHUP) ? AVAHI_WATCH_HUP : 0));
+}
+
+
+static void
+avahi_watch_event(int fd, unsigned int events, void *data)
+{
+	AvahiWatch *w = data;
+
+	w->happened = avahi_from_epoll(events);
+	w->callback(w, fd, w->happened, w->userdata);	// may free w
+}
+
+
+static AvahiWatch *
+avahi_watch_new(AVAHI_GCC_UNUSED const AvahiPoll *api, int fd, AvahiWatchEvent event,
+		AvahiWatchCallback callback, void *userdata)
+{
+	AvahiWatch *w = util_malloc(sizeof(AvahiWatch));
+
+	w->callback = callback;
+	w->userdata = userdata;
+	w->watch    = loop_watch_add(fd, avahi_to_epoll(event), avahi_watch_event, w);
+
+	return w;
+}
+
+
+static void
+avahi_watch_update(AvahiWatch *w, AvahiWatchEvent event)
+{
+	loop_watch_update(w->watch, avahi_to_epoll(event));
+}
+
+
+static AvahiWatchEvent
+avahi_watch_get_events(AvahiWatch *w)
+{
+	return w->happened;
+}
+
+
+static void
+avahi_watch_free(AvahiWatch *w)
+{
+	loop_watch_free(w->watch);
+	util_free(w);
+}
+
+
+static uint64_t
+avahi_timeout_due(const struct timeval *tv)
+{
+	struct timeval now;
+	int64_t usec;
+
+	if (tv == NULL) {
+		return 0;	// disarmed
+	}
+
+	gettimeofday(&now, NULL);
+	usec = (int64_t) (tv->tv_sec - now.tv_sec) * 1000000 + (tv->tv_usec - now.tv_usec);
+
+	return loop_now() + (usec > 0 ? (uint64_t) usec : 0);
+}
+
+
+static void
+avahi_timeout_event(void *data)
+{
+	AvahiTimeout *t = data;
+
+	t->callback(t, t->userdata);	// may free t
+}
+
+
+static AvahiTimeout *
+avahi_timeout_new(AVAHI_GCC_UNUSED const AvahiPoll *api, const struct timeval *tv,
+		AvahiTimeoutCallback callback, void *userdata)
+{
+	AvahiTimeout *t = util_malloc(sizeof(AvahiTimeout));
+
+	t->callback = callback;
+	t->userdata = userdata;
+	t->timer    = loop_timer_add(avahi_timeout_due(tv), avahi_timeout_event, t);
+
+	return t;
+}
+
+
+static void
+avahi_timeout_update(AvahiTimeout *t, const struct timeval *tv)
+{
+	loop_timer_set(t->timer, avahi_timeout_due(tv));
+}
+
+
+static void
+avahi_timeout_free(AvahiTimeout *t)
+{
+	loop_timer_free(t->timer);
+	util_free(t);
+}
+
+
+static const AvahiPoll my_poll_api = {
+	.userdata         = NULL,
+	.watch_new        = avahi_watch_new,
+	.watch_update     = avahi_watch_update,
+	.watch_get_events = avahi_watch_get_events,
+	.watch_free       = avahi_watch_free,
+	.timeout_new      = avahi_timeout_new,
+	.timeout_update   = avahi_timeout_update,
+	.timeout_free     = avahi_timeout_free,
+};
+
+
+static int
+avahi_done(void)
+{
+	if (my_browser_done >= my_browser_cnt && my_resolving <= 0) {
+		util_debug(3, "avahi_run() all browsers and resolvers done");
+		return 1;
+	}
+	if (my_race && request_satisfied(result_get_count() + result_get_type_count())) {
+		util_info("race got %d matching results, stop browsing", result_get_count() + result_get_type_count());
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Run the loop until the browsers and resolvers are done, a callback
+ * quits or the timeout is over (in a race the query's window). A hung
+ * daemon can't block us beyond that.
+ */
+
+static void
+avahi_run(void)
+{
+	uint64_t deadline;
+
+	deadline = my_race ? query_deadline() : loop_now() + (uint64_t) config_get_timeout() * 1000000;
+	if (loop_run(deadline, avahi_done) != 0) {
+		return;
+	}
+
+	if (my_resolving > 0) {
+		stats_add(STATS_RESOLVER_TIMEOUTS, my_resolving);
+		util_error(__func__, __LINE__, "Avahi timeout, %d resolvers did not report", my_resolving);
+	} else {
+		util_info("Avahi timeout, %d of %d browsers not done", my_browser_cnt - my_browser_done, my_browser_cnt);
+	}
+	trace_instant(TRACE_LANE_AVAHI, "avahi", "timeout", NULL);
+}
+
+
+/*
+ * Open the library on first use, -1 (and a query fallback) without it.
+ * libavahi-common comes along as a dependency of libavahi-client.
+ */
+
+static int
+avahi_load(void)
+{
+	if (my_library != NULL) {
+		return 0;
+	}
+
+	if ((my_library = dlopen(AVAHI_LIBRARY, RTLD_NOW | RTLD_LOCAL)) == NULL) {
+		util_info("Avahi not available: %s", dlerror());
+		return -1;
+	}
+
+#define AVAHI_SYMBOL(name) \
+	if ((my_##name = (__typeof__(my_##name)) dlsym(my_library, #name)) == NULL) { \
+		util_error(__func__, __LINE__, "%s not in %s", #name, AVAHI_LIBRARY); \
+		dlclose(my_library); \
+		my_library = NULL; \
+		return -1; \
+	}
+	AVAHI_SYMBOLS
+#undef AVAHI_SYMBOL
+
+	util_debug(1, "loaded %s", AVAHI_LIBRARY);
+
+	return 0;
+}
+
+
+/*
+ * Take Avahi off the loop once its stage is over. Freeing the client
+ * also frees the resolvers still in flight and returns its watches and
+ * timeouts, so no late callback adds results to the query's reply or
+ * quits the loop of the query or the probes.
+ */
+
+static void
+avahi_stop(void)
+{
+	if (my_resolving > 0) {
+		util_debug(1, "Avahi stop, dropping %d resolvers", my_resolving);
+		my_resolving = 0;
+	}
+	avahi_cleanup();
+}
+
+
+static result_t *
+avahi_browse_run(void)
+{
+	AvahiServiceResolver *resolver;
+	AvahiHostNameResolver *host;
+	AvahiServiceBrowser *browser;
+	AvahiServiceTypeBrowser *types_browser;
+	AvahiIfIndex interface;
+	const char *types[REQUEST_TYPES];
+	int error, idx, num, cnt;
+
+	if (avahi_load() < 0) {
 		return NULL;
 	}
-	util_debug(3, "success: avahi_simple_poll_new()");
+	util_info("calling Avahi browser");
 
-	my_client = avahi_client_new(avahi_simple_poll_get(my_poll), 0, avahi_client_callback, NULL, &error);
+	//
+	// Registered after the client made the loop, it has to go first at exit
+	//
+	my_client = my_avahi_client_new(&my_poll_api, 0, avahi_client_callback, NULL, &error);
+	atexit(avahi_cleanup);
 	if (my_client == NULL) {
-		util_error(__func__, __LINE__, "avahi_client_new() error %s", avahi_strerror(error));
+		util_error(__func__, __LINE__, "avahi_client_new() error %s", my_avahi_strerror(error));
 		return NULL;
 	}
 	util_debug(3, "success: avahi_client_new()");
+	timing_mark(TIMING_INIT);
 
-	my_browser = avahi_service_browser_new(my_client, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC,
-			"_http._tcp", NULL, 0, avahi_browse_callback, my_client);
-	if (my_browser == NULL) {
-		fprintf(stderr, "avahi_service_browser_new() error %s", avahi_strerror(avahi_client_errno(my_client)));
+	//
+	// The interface policy picks the interfaces to browse on
+	//
+	if ((my_iface_cnt = iface_find(my_ifaces, AVAHI_IFACES)) == 0) {
+		util_error(__func__, __LINE__, "no interface allowed by the interface policy");
 		return NULL;
 	}
-	util_debug(3, "success: avahi_service_browser_new()");
 
-	avahi_simple_poll_loop(my_poll);
+	//
+	// Resolve and ResolveHost skip the browser and ask for one name only
+	//
+	num = request_get_types(types, REQUEST_TYPES);
+	if (strcmp(request_get_cmd(), "Resolve") == 0) {
+		for (cnt = 0; cnt < num; cnt++) {
+			resolver = my_avahi_service_resolver_new(my_client, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC,
+					request_get_name(), types[cnt], "local",
+					AVAHI_PROTO_UNSPEC, avahi_lookup_flags(), avahi_resolve_callback, NULL);
+			if (resolver == NULL) {
+				util_error(__func__, __LINE__, "avahi_service_resolver_new() error %s",
+						my_avahi_strerror(my_avahi_client_errno(my_client)));
+				continue;
+			}
+			trace_begin("avahi", "resolve", resolver, request_get_name());
+			my_resolving++;
+			util_debug(3, "success: avahi_service_resolver_new() for %s", types[cnt]);
+		}
+		if (my_resolving == 0) {
+			return NULL;
+		}
+	} else if (strcmp(request_get_cmd(), "ResolveHost") == 0) {
+		host = my_avahi_host_name_resolver_new(my_client, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC,
+				request_get_host(), AVAHI_PROTO_UNSPEC, 0, avahi_host_callback, my_client);
+		if (host == NULL) {
+			util_error(__func__, __LINE__, "avahi_host_name_resolver_new() error %s",
+					my_avahi_strerror(my_avahi_client_errno(my_client)));
+			return NULL;
+		}
+		trace_begin("avahi", "resolve-host", host, request_get_host());
+		my_resolving++;
+		util_debug(3, "success: avahi_host_name_resolver_new()");
+	} else if (strcmp(request_get_cmd(), "Types") == 0) {
+		for (idx = 0; idx < (my_iface_cnt < 0 ? 1 : my_iface_cnt); idx++) {
+			interface = (my_iface_cnt < 0) ? AVAHI_IF_UNSPEC : (AvahiIfIndex) my_ifaces[idx].index;
+			types_browser = my_avahi_service_type_browser_new(my_client, interface, AVAHI_PROTO_UNSPEC,
+					NULL, 0, avahi_type_callback, (void *) (intptr_t) my_browser_cnt);
+			if (types_browser == NULL) {
+				util_error(__func__, __LINE__, "avahi_service_type_browser_new() error %s",
+						my_avahi_strerror(my_avahi_client_errno(my_client)));
+				continue;
+			}
+			my_type_browsers[my_browser_cnt++] = types_browser;
+			util_debug(3, "success: avahi_service_type_browser_new() on %d", interface);
+			trace_instant(TRACE_LANE_AVAHI, "avahi", "types start",
+					my_iface_cnt < 0 ? "any" : my_ifaces[idx].name);
+		}
+		if (my_browser_cnt == 0) {
+			return NULL;
+		}
+	} else {
+		for (cnt = 0; cnt < num; cnt++) {
+			for (idx = 0; idx < (my_iface_cnt < 0 ? 1 : my_iface_cnt); idx++) {
+				if (my_browser_cnt == AVAHI_BROWSERS) {
+					util_error(__func__, __LINE__, "too many browsers, skip %s", types[cnt]);
+					break;
+				}
+				interface = (my_iface_cnt < 0) ? AVAHI_IF_UNSPEC : (AvahiIfIndex) my_ifaces[idx].index;
+				browser = my_avahi_service_browser_new(my_client, interface, AVAHI_PROTO_UNSPEC,
+						types[cnt], NULL, 0, avahi_browse_callback, my_client);
+				if (browser == NULL) {
+					util_error(__func__, __LINE__, "avahi_service_browser_new() error %s",
+							my_avahi_strerror(my_avahi_client_errno(my_client)));
+					continue;
+				}
+				my_browsers[my_browser_cnt++] = browser;
+				util_debug(3, "success: avahi_service_browser_new() for %s on %d", types[cnt], interface);
+				trace_instant(TRACE_LANE_AVAHI, "avahi", "browse start",
+						my_iface_cnt < 0 ? "any" : my_ifaces[idx].name);
+			}
+		}
+		if (my_browser_cnt == 0) {
+			return NULL;
+		}
+	}
+
+	timing_mark(TIMING_SENT);
 
-	return my_results;
+	avahi_run();
+	timing_mark(TIMING_STOP);
+	trace_instant(TRACE_LANE_MAIN, "main", "stop", "avahi");
+
+	return result_get_list();
 }
 
+
+/*
+ * In a race Avahi stays on the loop until avahi_race() is done with
+ * the query window, otherwise it is stopped right here.
+ */
+
+result_t *
+avahi_browse(void)
+{
+	result_t *list;
+
+	list = avahi_browse_run();
+	if (my_race == 0) {
+		avahi_stop();
+	}
+
+	return list;
+}
+
+
+/*
+ * Run both backends at once: the query goes out first, then Avahi
+ * browses while the query sockets are read in the same loop. Both add
+ * to the one result list. Avahi being done (often from its cache) does
+ * not end the race, the query keeps listening for the rest of its
+ * window, unless "max" or a Resolve is satisfied already. Avahi leaves
+ * the loop together with the query.
+ */
+
+result_t *
+avahi_race(void)
+{
+	result_t *list;
+
+	util_info("racing Avahi and mDNS-SD query");
+	if (query_start() < 0) {
+		return avahi_browse();
+	}
+
+	my_race = 1;
+	if (avahi_browse() != NULL && request_satisfied(result_get_count() + result_get_type_count()) == 0) {
+		util_info("Avahi done with %d results, query listens on", result_get_count());
+	}
+	list = query_browse();
+	avahi_stop();
+
+	return list;
+}
@@ -0,0 +1,322 @@
+/****************************************************************************
+ *
+ * Copyright (c) 2017-2018 Volker Wiegand <volker@railduino.de>
+ *
+ * This file is part of Zeroconf-Lookup.
+ * Project home: https://www.railduino.de/zeroconf-lookup
+ * Source code:  https://github.com/railduino/zeroconf-lookup.git
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ ****************************************************************************/
+
+
+/*
+ * Receive path benchmark: a child floods a loopback UDP socket with
+ * mDNS sized datagrams, the parent reads them with each path query.c
+ * can use (recvmsg per wakeup, recvmmsg batches, io_uring multishot),
+ * all on the epoll loop. Reported are the packets read per second and
+ * the CPU time of the reader from getrusage().
+ *
+ *   make bench [BENCH_PACKETS=200000] [BENCH_SIZE=300]
+ *
+ * Loopback has no multicast, so the socket is plain unicast UDP. The
+ * receive side is the same, the numbers compare the paths, not the
+ * network.
+ */
+
+#define _GNU_SOURCE		// recvmmsg(), sendmmsg()
+
+#include "../common.h"
+
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+
+
+#define BENCH_BATCH	16		// as QUERY_BATCH
+#define BENCH_BURST	64		// datagrams per sendmmsg()
+#define BENCH_MAXSIZE	9000
+#define BENCH_CONTROL	64
+#define BENCH_DRAIN	200		// ms after the sender is done
+
+
+static int          my_sock   = -1;
+static unsigned long my_packets = 0;
+static unsigned long my_wanted  = 0;
+static uint64_t     my_first, my_last;
+static loop_timer_t *my_drain = NULL;
+
+
+static void
+bench_count(void)
+{
+	my_last = loop_now();
+	if (my_packets++ == 0) {
+		my_first = my_last;
+	}
+}
+
+
+static void
+bench_recvmsg(int fd, unsigned int events, void *data)
+{
+	static char buf[BENCH_MAXSIZE], ctl[BENCH_CONTROL];
+	struct sockaddr_storage addr;
+	struct msghdr msg;
+	struct iovec iov;
+
+	(void) events;
+	(void) data;
+
+	memset(&msg, '\0', sizeof(msg));
+	iov.iov_base = buf;
+	iov.iov_len  = sizeof(buf);
+	msg.msg_name       = &addr;
+	msg.msg_namelen    = sizeof(addr);
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = ctl;
+	msg.msg_controllen = sizeof(ctl);
+
+	if (recvmsg(fd, &msg, MSG_DONTWAIT) > 0) {
+		bench_count();
+	}
+}
+
+
+static void
+bench_recvmmsg(int fd, unsigned int events, void *data)
+{
+	static char bufs[BENCH_BATCH][BENCH_MAXSIZE], ctls[BENCH_BATCH][BENCH_CONTROL];
+	static struct sockaddr_storage addrs[BENCH_BATCH];
+	struct mmsghdr msgs[BENCH_BATCH];
+	struct iovec iovs[BENCH_BATCH];
+	int idx, cnt;
+
+	(void) events;
+	(void) data;
+
+	memset(msgs, '\0', sizeof(msgs));
+	for (idx = 0; idx < BENCH_BATCH; idx++) {
+		iovs[idx].iov_base = bufs[idx];
+		iovs[idx].iov_len  = BENCH_MAXSIZE;
+		msgs[idx].msg_hdr.msg_name       = &addrs[idx];
+		msgs[idx].msg_hdr.msg_namelen    = sizeof(addrs[idx]);
+		msgs[idx].msg_hdr.msg_iov        = &iovs[idx];
+		msgs[idx].msg_hdr.msg_iovlen     = 1;
+		msgs[idx].msg_hdr.msg_control    = ctls[idx];
+		msgs[idx].msg_hdr.msg_controllen = BENCH_CONTROL;
+	}
+
+	cnt = recvmmsg(fd, msgs, BENCH_BATCH, MSG_DONTWAIT, NULL);
+	for (idx = 0; idx < cnt; idx++) {
+		bench_count();
+	}
+}
+
+
+static void
+bench_uring(int sock, char *buf, int len, struct msghdr *msg)
+{
+	(void) sock;
+	(void) msg;
+
+	if (buf == NULL) {
+		util_error(__func__, __LINE__, "io_uring stopped: %s", strerror(-len));
+		loop_quit();
+		return;
+	}
+	bench_count();
+}
+
+
+static int
+bench_done(void)
+{
+	return my_packets >= my_wanted;
+}
+
+
+static void
+bench_drained(void *data)
+{
+	(void) data;
+
+	loop_quit();
+}
+
+
+/*
+ * The sender reports the end of the flood on the pipe, what is still
+ * in the socket gets BENCH_DRAIN ms
+ */
+
+static void
+bench_sender_done(int fd, unsigned int events, void *data)
+{
+	char chr;
+
+	(void) events;
+	(void) data;
+
+	if (read(fd, &chr, 1) <= 0 && my_drain == NULL) {
+		my_drain = loop_timer_add(loop_now() + BENCH_DRAIN * 1000, bench_drained, NULL);
+	}
+}
+
+
+static void
+bench_send(struct sockaddr_in *to, unsigned long count, int size, int done)
+{
+	static char buf[BENCH_MAXSIZE];
+	struct mmsghdr msgs[BENCH_BURST];
+	struct iovec iov;
+	unsigned long sent;
+	int idx, num;
+
+	memset(buf, 'x', sizeof(buf));
+	iov.iov_base = buf;
+	iov.iov_len  = size;
+
+	memset(msgs, '\0', sizeof(msgs));
+	for (idx = 0; idx < BENCH_BURST; idx++) {
+		msgs[idx].msg_hdr.msg_name    = to;
+		msgs[idx].msg_hdr.msg_namelen = sizeof(*to);
+		msgs[idx].msg_hdr.msg_iov     = &iov;
+		msgs[idx].msg_hdr.msg_iovlen  = 1;
+	}
+
+	for (sent = 0; sent < count; sent += num) {
+		num = (count - sent < BENCH_BURST) ? (int) (count - sent) : BENCH_BURST;
+		if ((num = sendmmsg(my_sock, msgs, num, 0)) < 0) {
+			util_fatal("sendmmsg: %s", strerror(errno));
+		}
+	}
+	close(done);
+	_exit(EXIT_SUCCESS);
+}
+
+
+static double
+bench_cpu_ms(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+
+	return usage.ru_utime.tv_sec * 1000.0 + usage.ru_utime.tv_usec / 1000.0 +
+	       usage.ru_stime.tv_sec * 1000.0 + usage.ru_stime.tv_usec / 1000.0;
+}
+
+
+static void
+bench_run(const char *path, unsigned long count, int size)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	loop_watch_t *watch = NULL, *pipe_watch;
+	int fds[2], on = 1, rcvbuf = 4 * 1024 * 1024;
+	double cpu, secs;
+	pid_t pid;
+
+	if ((my_sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+		util_fatal("socket: %s", strerror(errno));
+	}
+	setsockopt(my_sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	setsockopt(my_sock, IPPROTO_IP, IP_PKTINFO, &on, sizeof(on));
+	memset(&addr, '\0', sizeof(addr));
+	addr.sin_family      = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(my_sock, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+			getsockname(my_sock, (struct sockaddr *) &addr, &len) < 0) {
+		util_fatal("bind: %s", strerror(errno));
+	}
+
+	if (strcmp(path, "io_uring") == 0) {
+		if (uring_open(BENCH_MAXSIZE) < 0 ||
+				uring_recvmsg(my_sock, sizeof(struct sockaddr_storage), BENCH_CONTROL, bench_uring) < 0) {
+			printf("%-9s  not available\n", path);
+			uring_close();
+			close(my_sock);
+			return;
+		}
+	} else {
+		watch = loop_watch_add(my_sock, EPOLLIN,
+				strcmp(path, "recvmsg") == 0 ? bench_recvmsg : bench_recvmmsg, NULL);
+	}
+
+	my_packets = 0;
+	my_wanted  = count;
+	my_drain   = NULL;
+	if (pipe(fds) < 0) {
+		util_fatal("pipe: %s", strerror(errno));
+	}
+	pipe_watch = loop_watch_add(fds[0], EPOLLIN, bench_sender_done, NULL);
+
+	cpu = bench_cpu_ms();
+	if ((pid = fork()) == 0) {
+		close(fds[0]);
+		bench_send(&addr, count, size, fds[1]);
+	}
+	close(fds[1]);
+
+	loop_run(loop_now() + 30000000, bench_done);
+	cpu = bench_cpu_ms() - cpu;
+	waitpid(pid, NULL, 0);
+
+	loop_timer_free(my_drain);
+	loop_watch_free(pipe_watch);
+	close(fds[0]);
+	if (watch != NULL) {
+		loop_watch_free(watch);
+	} else {
+		uring_close();
+	}
+	close(my_sock);
+
+	secs = (my_packets > 1) ? (my_last - my_first) / 1e6 : 0.0;
+	printf("%-9s  %9lu  %9lu  %9.0f  %9.1f  %9.3f\n", path, my_packets, count - my_packets,
+			secs > 0.0 ? my_packets / secs : 0.0, cpu, my_packets > 0 ? cpu * 1000.0 / my_packets : 0.0);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	unsigned long count = 200000;
+	int size = 300;
+
+	if (argc > 1) {
+		count = strtoul(argv[1], NULL, 10);
+	}
+	if (argc > 2 && (size = atoi(argv[2])) > BENCH_MAXSIZE) {
+		size = BENCH_MAXSIZE;
+	}
+
+	printf("%lu datagrams of %d bytes on loopback\n\n", count, size);
+	printf("%-9s  %9s  %9s  %9s  %9s  %9s\n", "path", "packets", "dropped", "pps", "CPU ms", "us/packet");
+	bench_run("recvmsg", count, size);
+	bench_run("recvmmsg", count, size);
+	bench_run("io_uring", count, size);
+
+	return EXIT_SUCCESS;
+}
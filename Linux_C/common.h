@@ -37,12 +37,8 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
-
-
-typedef struct _result {
-	struct _result	*next;
-	char		*text;
-} result_t;
+#include <net/if.h>
+#include <netinet/in.h>
 
 
 typedef union {
@@ -57,24 +53,231 @@ typedef struct _txt {
 } txt_t;
 
 
+typedef struct _addr {
+	struct _addr *next;
+	int	rank;				// see iface_rank()
+	double	rtt_ms;				// -1 if not measured
+	char	text[INET6_ADDRSTRLEN];
+	char	iface[IF_NAMESIZE];		// where it was seen, "" if unknown
+} addr_t;
+
+
+typedef struct _result {
+	struct _result	*next;
+	char		*name;
+	char		*type;		// "_http._tcp", NULL for a host
+	char		*target;
+	int		port;
+	char		*a;		// best address, the one in url
+	char		*url;
+	addr_t		*addrs;		// all addresses, best first
+	txt_t		*txt;
+	int		source;		// RESULT_AVAHI and/or RESULT_QUERY
+	int		cached;		// answered from the Avahi cache
+	int		reachable;	// -1 if not probed
+	double		connect_ms;	// -1 if no connection
+} result_t;
+
+#define RESULT_AVAHI	1
+#define RESULT_QUERY	2
+
+
+typedef struct {
+	char		name[IF_NAMESIZE];
+	unsigned int	index;
+	struct in_addr	addr;		// 0 if the interface has no IPv4 address
+	int		inet6;		// has an IPv6 address
+} iface_t;
+
+
 // Prototypes for config.c
 
-void  config_read(char *google, char *mozilla, char *timeout, char *force);
+void  config_read(char *google, char *mozilla, char *timeout, char *force, char *rcvbuf);
 
 char *config_get_google(void);
 char *config_get_mozilla(void);
 int   config_get_timeout(void);
 char *config_get_force(void);
+int   config_get_rcvbuf(void);
+char *config_get_interfaces(void);
+char *config_get_exclude(void);
+int   config_get_probe(void);
+char *config_get_receive(void);
+char *config_get_types(void);
+
+
+// Prototypes for loop.c
+
+typedef struct _loop_watch loop_watch_t;
+typedef struct _loop_timer loop_timer_t;
+
+uint64_t      loop_now(void);
+loop_watch_t *loop_watch_add(int fd, unsigned int events, void (*callback)(int fd, unsigned int events, void *data), void *data);
+void          loop_watch_update(loop_watch_t *watch, unsigned int events);
+void          loop_watch_free(loop_watch_t *watch);
+loop_timer_t *loop_timer_add(uint64_t due, void (*callback)(void *data), void *data);
+void          loop_timer_set(loop_timer_t *timer, uint64_t due);
+void          loop_timer_free(loop_timer_t *timer);
+void          loop_quit(void);
+int           loop_run(uint64_t deadline, int (*done)(void));
 
 
 // Prototypes for avahi.c
 
 result_t *avahi_browse(void);
+result_t *avahi_race(void);
 
 
 // Prototypes for query.c
 
 result_t *query_browse(void);
+int       query_start(void);
+uint64_t  query_deadline(void);
+void      query_stop(void);
+
+
+// Prototypes for uring.c
+
+int   uring_open(int size);
+int   uring_recvmsg(int sock, socklen_t namelen, socklen_t controllen,
+		void (*callback)(int sock, char *buf, int len, struct msghdr *msg));
+void  uring_close(void);
+
+
+// Prototypes for iface.c
+
+int   iface_allowed(const char *name, unsigned int flags);
+int   iface_find(iface_t *list, int max);
+int   iface_rank(const char *addr);
+
+#define IFACE_RANK_SUBNET	0	// on one of our subnets
+#define IFACE_RANK_ROUTED	1	// same family, needs a router
+#define IFACE_RANK_LINK		2	// link-local
+#define IFACE_RANK_NONE		3	// loopback or no local address of that family
+
+
+// Prototypes for request.c
+
+#define REQUEST_TYPES	16		// service types per lookup
+
+void  request_parse(char *input);
+char *request_get_cmd(void);
+char *request_get_name(void);
+char *request_get_host(void);
+int   request_get_host_port(void);
+int   request_get_max(void);
+int   request_get_compact(void);
+int   request_get_timing(void);
+char *request_get_continue(void);
+char *request_get_interfaces(void);
+char *request_get_exclude(void);
+int   request_get_types(const char **list, int max);
+int   request_get_probe(void);
+int   request_get_drop(void);
+int   request_get_fresh(void);
+int   request_need_txt(void);
+
+int   request_match_name(const char *name);
+int   request_match(const char *name, const txt_t *txt, int port);
+int   request_satisfied(int count);
+
+
+// Prototypes for probe.c
+
+enum {
+	PROBE_NONE = 0,
+	PROBE_CONNECT,		// TCP connect only
+	PROBE_HEAD,		// connect and "HEAD /"
+	PROBE_RACE		// all addresses, the fastest one wins
+};
+
+void  probe_results(result_t *list, int mode);
+
+
+// Prototypes for result.c
+
+result_t *result_new(const char *name, const char *type, const char *target, int port,
+		const char *addr, const char *iface, txt_t *txt);
+void      result_add_address(result_t *res, const char *addr, const char *iface);
+void      result_prefer_address(result_t *res, addr_t *addr);
+int       result_drop_unreachable(void);
+int       result_add(result_t *res);
+result_t *result_get_list(void);
+int       result_get_count(void);
+int       result_add_type(const char *type);
+int       result_get_type_count(void);
+result_t *result_sort(void);
+
+char     *result_token(const result_t *res, char *dst, size_t len);
+int       result_after(const result_t *res, const char *token);
+int       result_trim_txt(result_t *res);
+size_t    result_format(const result_t *res, char *dst, size_t len, int compact);
+size_t    result_format_types(char *dst, size_t len, int compact);
+
+
+// Prototypes for timing.c
+
+enum {
+	TIMING_START = 0,
+	TIMING_CONFIG,
+	TIMING_FALLBACK,	// Avahi gave nothing, the query starts over
+	TIMING_INIT,
+	TIMING_SENT,
+	TIMING_FIRST,
+	TIMING_LAST,
+	TIMING_STOP,
+	TIMING_PROBE,
+	TIMING_SERIALIZE,
+	TIMING_WRITE,
+	TIMING_COUNT
+};
+
+void   timing_mark(int phase);
+void   timing_answer(void);
+void   timing_fallback(void);
+size_t timing_format(char *dst, size_t len, int compact);
+void   timing_log(void);
+
+
+// Prototypes for stats.c
+
+enum {
+	STATS_RESPONSES = 0,
+	STATS_QUERIES,
+	STATS_UNKNOWN_RR,
+	STATS_INCOMPLETE,
+	STATS_DUPLICATES,
+	STATS_RESOLVER_FAILURES,
+	STATS_RESOLVER_TIMEOUTS,
+	STATS_COALESCED,
+	STATS_RXQ_OVERFLOWS,
+	STATS_COUNT
+};
+
+void          stats_inc(int counter);
+void          stats_add(int counter, unsigned long value);
+void          stats_set(int counter, unsigned long value);
+unsigned long stats_get(int counter);
+void          stats_parse_error(const char *reason);
+size_t        stats_format(char *dst, size_t len);
+
+
+// Prototypes for trace.c
+
+#define TRACE_LANE_MAIN		1
+#define TRACE_LANE_AVAHI	2
+#define TRACE_LANE_QUERY	3
+#define TRACE_LANE_RESPONDER	100
+
+void     trace_open(char *file);
+int      trace_enabled(void);
+uint64_t trace_now(void);
+int      trace_responder(const char *addr);
+void     trace_lane(int lane, const char *label);
+void     trace_instant(int lane, const char *cat, const char *name, const char *detail);
+void     trace_complete(int lane, const char *cat, const char *name, uint64_t start, const char *detail, int count);
+void     trace_begin(const char *cat, const char *name, const void *id, const char *detail);
+void     trace_end(const char *cat, const char *name, const void *id, const char *detail);
 
 
 // Prototypes for install.c
@@ -97,15 +300,32 @@ char *util_strcpy(char *dst, const char *src, size_t len);
 char *util_strcat(char *dst, const char *src, size_t len);
 char *util_strtrim(char *src, const char *trim);
 char *util_append(char *dst, size_t len, char *fmt, ...);
+size_t util_json_escape(char *dst, size_t len, const char *src);
 
 void util_inc_verbose(void);
 int  util_get_verbose(void);
 
 void util_open_logfile(char *logfile);
-void util_debug(int level, char *msg, ...);
+void util_debug_write(int level, char *msg, ...) __attribute__((format(printf, 2, 3)));
 void util_info(char *msg, ...);
 void util_error(const char *func, int line, char *msg, ...);
 void util_fatal(char *msg, ...);
 
+/*
+ * Debug logging checks the level before anything gets formatted, so a
+ * disabled call costs a single compare. Building with -DUTIL_NO_DEBUG
+ * (make DEBUG=0) removes the calls altogether; the dead branch keeps the
+ * arguments type-checked and "used".
+ */
+extern int util_verbose;
+
+#ifdef UTIL_NO_DEBUG
+#define util_debug(level, ...) \
+	do { if (0) util_debug_write((level), __VA_ARGS__); } while (0)
+#else
+#define util_debug(level, ...) \
+	do { if ((level) <= util_verbose) util_debug_write((level), __VA_ARGS__); } while (0)
+#endif
+
 #endif /* !_COMMON_H */
 
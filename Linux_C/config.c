@@ -30,10 +30,23 @@
 #include "config.h"
 
 
+#define RCVBUF_SIZE	"262144"	// bytes, the usual rmem_default is 208k
+#define IF_EXCLUDE	"docker*,veth*,virbr*,vnet*,br-*"	// container and VM bridges
+#define PROBE_TIME	"800"		// ms for all probes together
+#define RECV_PATH	"auto"		// io_uring if the kernel has it, else recvmmsg
+#define SERVICE_TYPES	"_http._tcp"
+
+
 static char my_google[256];
 static char my_mozilla[256];
 static char my_timeout[32];
 static char my_force[32];
+static char my_rcvbuf[32];
+static char my_interfaces[1024];
+static char my_exclude[1024];
+static char my_probe[32];
+static char my_receive[32];
+static char my_types[1024];
 
 static char *my_cfgfile = CONFIG_FILE;
 
@@ -112,8 +125,8 @@ config_set_force(char *val, char *auth)
 	if (val == NULL) {
 		util_fatal("missing force [%s]", auth);
 	}
-	if (*val && strcmp(val, "avahi") != 0 && strcmp(val, "query") != 0) {
-		util_fatal("invalid force '%s' [%s] (only avahi or query)", val, auth);
+	if (*val && strcmp(val, "avahi") != 0 && strcmp(val, "query") != 0 && strcmp(val, "both") != 0) {
+		util_fatal("invalid force '%s' [%s] (only avahi, query or both)", val, auth);
 	}
 	UTIL_STRCPY(my_force, val);
 	util_info("[%s] force   '%s'", auth, my_force);
@@ -127,8 +140,157 @@ config_get_force(void)
 }
 
 
+/*
+ * Receive buffer of the mDNS socket in bytes; the kernel default
+ * overflows when many responders answer at the same time
+ */
+
+static void
+config_set_rcvbuf(char *val, char *auth)
+{
+	int num;
+
+	if (val == NULL) {
+		util_fatal("missing rcvbuf [%s]", auth);
+	}
+	if ((num = atoi(val)) < 16384 || num > 16777216) {
+		util_fatal("invalid rcvbuf %d [%s] (only 16384 to 16777216)", num, auth);
+	}
+
+	snprintf(my_rcvbuf, sizeof(my_rcvbuf), "%d", num);
+	util_info("[%s] rcvbuf  '%s'", auth, my_rcvbuf);
+}
+
+
+int
+config_get_rcvbuf(void)
+{
+	return atoi(my_rcvbuf);
+}
+
+
+/*
+ * Comma separated interface name patterns, see iface.c
+ */
+
+static void
+config_set_interfaces(char *val, char *auth)
+{
+	if (val == NULL) {
+		util_fatal("missing interfaces [%s]", auth);
+	}
+
+	UTIL_STRCPY(my_interfaces, val);
+	util_info("[%s] interfaces '%s'", auth, my_interfaces);
+}
+
+
+char *
+config_get_interfaces(void)
+{
+	return my_interfaces;
+}
+
+
+/*
+ * Comma separated service types to browse, see request_get_types()
+ */
+
+static void
+config_set_types(char *val, char *auth)
+{
+	if (val == NULL || *val == '\0') {
+		util_fatal("missing types [%s]", auth);
+	}
+
+	UTIL_STRCPY(my_types, val);
+	util_info("[%s] types   '%s'", auth, my_types);
+}
+
+
+char *
+config_get_types(void)
+{
+	return my_types;
+}
+
+
+static void
+config_set_exclude(char *val, char *auth)
+{
+	if (val == NULL) {
+		util_fatal("missing exclude [%s]", auth);
+	}
+
+	UTIL_STRCPY(my_exclude, val);
+	util_info("[%s] exclude '%s'", auth, my_exclude);
+}
+
+
+char *
+config_get_exclude(void)
+{
+	return my_exclude;
+}
+
+
+/*
+ * Deadline (ms) shared by all reachability probes, see probe.c
+ */
+
+static void
+config_set_probe(char *val, char *auth)
+{
+	int num;
+
+	if (val == NULL) {
+		util_fatal("missing probe [%s]", auth);
+	}
+	if ((num = atoi(val)) < 50 || num > 10000) {
+		util_fatal("invalid probe %d [%s] (only 50 to 10000)", num, auth);
+	}
+
+	snprintf(my_probe, sizeof(my_probe), "%d", num);
+	util_info("[%s] probe   '%s'", auth, my_probe);
+}
+
+
+int
+config_get_probe(void)
+{
+	return atoi(my_probe);
+}
+
+
+/*
+ * How query.c reads its sockets: auto, io_uring, recvmmsg or recvmsg.
+ * The fixed choices are there to compare the paths on a busy network.
+ */
+
+static void
+config_set_receive(char *val, char *auth)
+{
+	if (val == NULL) {
+		util_fatal("missing receive [%s]", auth);
+	}
+	if (strcmp(val, "auto") != 0 && strcmp(val, "io_uring") != 0 &&
+			strcmp(val, "recvmmsg") != 0 && strcmp(val, "recvmsg") != 0) {
+		util_fatal("invalid receive '%s' [%s] (only auto, io_uring, recvmmsg or recvmsg)", val, auth);
+	}
+	UTIL_STRCPY(my_receive, val);
+	util_info("[%s] receive '%s'", auth, my_receive);
+}
+
+
+char *
+config_get_receive(void)
+{
+	return my_receive;
+}
+
+
 void
-config_read(char *google, char *mozilla, char *timeout, char *force)
+config_read(char *google, char *mozilla, char *timeout, char *force, char *rcvbuf)
 {
 	static char *inst = "install", *conf = "cfgfile", *argv = "cmdline";
 	FILE *fp;
@@ -138,6 +300,12 @@ config_read(char *google, char *mozilla, char *timeout, char *force)
 	config_set_mozilla(MOZILLA_TAG, inst);
 	config_set_timeout(TIME_OUT,    inst);
 	config_set_force(FORCE_METHOD,  inst);
+	config_set_rcvbuf(RCVBUF_SIZE,  inst);
+	config_set_interfaces("",       inst);
+	config_set_exclude(IF_EXCLUDE,  inst);
+	config_set_probe(PROBE_TIME,    inst);
+	config_set_receive(RECV_PATH,   inst);
+	config_set_types(SERVICE_TYPES, inst);
 
 	if ((fp = fopen(my_cfgfile, "r")) != NULL) {
 		while (fgets(line, sizeof(line), fp) != NULL) {
@@ -166,6 +334,30 @@ config_read(char *google, char *mozilla, char *timeout, char *force)
 				config_set_force(val, conf);
 				continue;
 			}
+			if (strcmp(var, "rcvbuf") == 0) {
+				config_set_rcvbuf(val, conf);
+				continue;
+			}
+			if (strcmp(var, "interfaces") == 0) {
+				config_set_interfaces(val, conf);
+				continue;
+			}
+			if (strcmp(var, "exclude") == 0) {
+				config_set_exclude(val, conf);
+				continue;
+			}
+			if (strcmp(var, "probe") == 0) {
+				config_set_probe(val, conf);
+				continue;
+			}
+			if (strcmp(var, "receive") == 0) {
+				config_set_receive(val, conf);
+				continue;
+			}
+			if (strcmp(var, "types") == 0) {
+				config_set_types(val, conf);
+				continue;
+			}
 			util_info("ignore config line '%s=%s'", var, val);
 		}
 		fclose(fp);
@@ -183,5 +375,10 @@ config_read(char *google, char *mozilla, char *timeout, char *force)
 	if (*force != '\0') {
 		config_set_force(force, argv);
 	}
+	if (*rcvbuf != '\0') {
+		config_set_rcvbuf(rcvbuf, argv);
+	}
+
+	timing_mark(TIMING_CONFIG);
 }
 
@@ -0,0 +1,266 @@
+/****************************************************************************
+ *
+ * Copyright (c) 2017-2018 Volker Wiegand <volker@railduino.de>
+ *
+ * This file is part of Zeroconf-Lookup.
+ * Project home: https://www.railduino.de/zeroconf-lookup
+ * Source code:  https://github.com/railduino/zeroconf-lookup.git
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ ****************************************************************************/
+
+#include "common.h"
+
+#include <arpa/inet.h>
+#include <fnmatch.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+
+
+#define IFACE_PREFIXES	64
+
+
+typedef struct {
+	int		family;
+	unsigned char	addr[16];
+	unsigned char	mask[16];
+} prefix_t;
+
+
+static prefix_t my_prefixes[IFACE_PREFIXES];
+static int      my_prefix_cnt = -1;
+
+
+/*
+ * Interface policy shared by both backends: the link has to be up,
+ * running and multicast capable, loopback and point-to-point links are
+ * skipped, then the include and exclude patterns (comma separated, shell
+ * wildcards) decide. Patterns from the request replace the config ones.
+ */
+
+static int
+iface_match_list(const char *list, const char *name)
+{
+	char buffer[1024], *pattern, *save;
+
+	UTIL_STRCPY(buffer, list);
+	for (pattern = strtok_r(buffer, ", ", &save); pattern != NULL; pattern = strtok_r(NULL, ", ", &save)) {
+		if (fnmatch(pattern, name, 0) == 0) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+int
+iface_allowed(const char *name, unsigned int flags)
+{
+	const char *include, *exclude;
+
+	if ((flags & (IFF_UP | IFF_RUNNING | IFF_MULTICAST)) != (IFF_UP | IFF_RUNNING | IFF_MULTICAST)) {
+		return 0;
+	}
+	if ((flags & (IFF_LOOPBACK | IFF_POINTOPOINT)) != 0) {
+		return 0;
+	}
+
+	include = *request_get_interfaces() ? request_get_interfaces() : config_get_interfaces();
+	exclude = *request_get_exclude()    ? request_get_exclude()    : config_get_exclude();
+
+	if (*include != '\0' && iface_match_list(include, name) == 0) {
+		return 0;
+	}
+	if (*exclude != '\0' && iface_match_list(exclude, name) == 1) {
+		return 0;
+	}
+
+	return 1;
+}
+
+
+/*
+ * Fill list with the allowed interfaces (one entry per index, noting the
+ * IPv4 address and whether IPv6 is there), returns the number found or -1
+ * if the interfaces can't be read
+ */
+
+int
+iface_find(iface_t *list, int max)
+{
+	struct ifaddrs *all, *ifa;
+	unsigned int index;
+	int cnt, idx;
+
+	if (getifaddrs(&all) == -1) {
+		util_error(__func__, __LINE__, "getifaddrs: %s", strerror(errno));
+		return -1;
+	}
+
+	for (ifa = all, cnt = 0; ifa != NULL; ifa = ifa->ifa_next) {
+		if (ifa->ifa_addr == NULL) {
+			continue;
+		}
+		if (ifa->ifa_addr->sa_family != AF_INET && ifa->ifa_addr->sa_family != AF_INET6) {
+			continue;
+		}
+		if ((index = if_nametoindex(ifa->ifa_name)) == 0) {
+			continue;
+		}
+		for (idx = 0; idx < cnt; idx++) {
+			if (list[idx].index == index) {
+				break;		// already have an address for this one
+			}
+		}
+		if (idx == cnt) {
+			if (cnt == max || iface_allowed(ifa->ifa_name, ifa->ifa_flags) == 0) {
+				util_debug(1, "skip interface %s", ifa->ifa_name);
+				continue;
+			}
+			memset(&list[cnt], '\0', sizeof(list[cnt]));
+			UTIL_STRCPY(list[cnt].name, ifa->ifa_name);
+			list[cnt].index = index;
+			cnt++;
+		}
+
+		if (ifa->ifa_addr->sa_family == AF_INET6) {
+			list[idx].inet6 = 1;
+		} else if (list[idx].addr.s_addr == 0) {
+			list[idx].addr = ((struct sockaddr_in *) ifa->ifa_addr)->sin_addr;
+		}
+	}
+
+	for (idx = 0; idx < cnt; idx++) {
+		util_info("mDNS interface %s (%s%s)", list[idx].name,
+				list[idx].addr.s_addr != 0 ? inet_ntoa(list[idx].addr) : "no IPv4",
+				list[idx].inet6 ? ", IPv6" : "");
+	}
+
+	freeifaddrs(all);
+
+	return cnt;
+}
+
+
+/*
+ * Remember address and netmask of every local interface (any policy)
+ */
+
+static void
+iface_load_prefixes(void)
+{
+	struct ifaddrs *all, *ifa;
+	prefix_t *pfx;
+
+	my_prefix_cnt = 0;
+	if (getifaddrs(&all) == -1) {
+		util_error(__func__, __LINE__, "getifaddrs: %s", strerror(errno));
+		return;
+	}
+
+	for (ifa = all; ifa != NULL && my_prefix_cnt < IFACE_PREFIXES; ifa = ifa->ifa_next) {
+		if (ifa->ifa_addr == NULL || ifa->ifa_netmask == NULL || (ifa->ifa_flags & IFF_UP) == 0) {
+			continue;
+		}
+
+		pfx = &my_prefixes[my_prefix_cnt];
+		pfx->family = ifa->ifa_addr->sa_family;
+		if (pfx->family == AF_INET) {
+			memcpy(pfx->addr, &((struct sockaddr_in *) ifa->ifa_addr)->sin_addr, 4);
+			memcpy(pfx->mask, &((struct sockaddr_in *) ifa->ifa_netmask)->sin_addr, 4);
+		} else if (pfx->family == AF_INET6) {
+			memcpy(pfx->addr, &((struct sockaddr_in6 *) ifa->ifa_addr)->sin6_addr, 16);
+			memcpy(pfx->mask, &((struct sockaddr_in6 *) ifa->ifa_netmask)->sin6_addr, 16);
+		} else {
+			continue;
+		}
+		my_prefix_cnt++;
+	}
+
+	freeifaddrs(all);
+}
+
+
+/*
+ * Rank an address by how likely a browser can reach it from here,
+ * lower is better (IFACE_RANK_*). Loopback addresses announced by
+ * other hosts are never reachable, neither is a family we don't have.
+ */
+
+int
+iface_rank(const char *addr)
+{
+	unsigned char bin[16];
+	int family, size, idx, pos, routed;
+
+	if (my_prefix_cnt < 0) {
+		iface_load_prefixes();
+	}
+
+	if (inet_pton(AF_INET, addr, bin) == 1) {
+		family = AF_INET;
+		size   = 4;
+		if (bin[0] == 127 || bin[0] == 0) {
+			return IFACE_RANK_NONE;
+		}
+		if (bin[0] == 169 && bin[1] == 254) {
+			return IFACE_RANK_LINK;
+		}
+	} else if (inet_pton(AF_INET6, addr, bin) == 1) {
+		family = AF_INET6;
+		size   = 16;
+		if (IN6_IS_ADDR_LOOPBACK((struct in6_addr *) bin) || IN6_IS_ADDR_UNSPECIFIED((struct in6_addr *) bin)) {
+			return IFACE_RANK_NONE;
+		}
+		if (IN6_IS_ADDR_LINKLOCAL((struct in6_addr *) bin)) {
+			return IFACE_RANK_LINK;
+		}
+	} else {
+		return IFACE_RANK_NONE;
+	}
+
+	for (idx = 0, routed = 0; idx < my_prefix_cnt; idx++) {
+		if (my_prefixes[idx].family != family) {
+			continue;
+		}
+		if (family == AF_INET6 && IN6_IS_ADDR_LINKLOCAL((struct in6_addr *) my_prefixes[idx].addr)) {
+			continue;	// a link-local address alone doesn't route
+		}
+		if (family == AF_INET && my_prefixes[idx].addr[0] == 127) {
+			continue;
+		}
+		if (family == AF_INET6 && IN6_IS_ADDR_LOOPBACK((struct in6_addr *) my_prefixes[idx].addr)) {
+			continue;
+		}
+		routed = 1;
+
+		for (pos = 0; pos < size; pos++) {
+			if ((bin[pos] & my_prefixes[idx].mask[pos]) != (my_prefixes[idx].addr[pos] & my_prefixes[idx].mask[pos])) {
+				break;
+			}
+		}
+		if (pos == size) {
+			return IFACE_RANK_SUBNET;
+		}
+	}
+
+	return routed ? IFACE_RANK_ROUTED : IFACE_RANK_NONE;
+}
@@ -0,0 +1,345 @@
+/****************************************************************************
+ *
+ * Copyright (c) 2017-2018 Volker Wiegand <volker@railduino.de>
+ *
+ * This file is part of Zeroconf-Lookup.
+ * Project home: https://www.railduino.de/zeroconf-lookup
+ * Source code:  https://github.com/railduino/zeroconf-lookup.git
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ ****************************************************************************/
+
+#include "common.h"
+
+#include <sys/epoll.h>
+#include <time.h>
+
+
+/*
+ * The one event loop of the program: stdin, the mDNS sockets, the
+ * probes and (through the adapter in avahi.c) the Avahi client all
+ * register their descriptors and timers here. Callbacks may add or
+ * free watches and timers at any time, freed ones are only marked and
+ * swept after the dispatch.
+ *
+ * Several watches may share a descriptor (D-Bus has one for reading
+ * and one for writing), epoll gets the union of their events.
+ */
+
+#define LOOP_EVENTS	32
+
+
+struct _loop_watch {
+	struct _loop_watch *next;
+	int		fd;
+	unsigned int	events;		// EPOLLIN, EPOLLOUT
+	void		(*callback)(int fd, unsigned int events, void *data);
+	void		*data;
+	int		dead;
+};
+
+
+struct _loop_timer {
+	struct _loop_timer *next;
+	uint64_t	due;		// loop_now(), 0 if not armed
+	void		(*callback)(void *data);
+	void		*data;
+	int		dead;
+};
+
+
+static int           my_epfd    = -1;
+static loop_watch_t *my_watches = NULL;
+static loop_timer_t *my_timers  = NULL;
+static int           my_quit    = 0;
+
+
+/*
+ * Monotonic time in microseconds
+ */
+
+uint64_t
+loop_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+
+static void
+loop_cleanup(void)
+{
+	loop_watch_t *watch;
+	loop_timer_t *timer;
+
+	while ((watch = my_watches) != NULL) {
+		my_watches = watch->next;
+		util_free(watch);
+	}
+	while ((timer = my_timers) != NULL) {
+		my_timers = timer->next;
+		util_free(timer);
+	}
+	if (my_epfd >= 0) {
+		close(my_epfd);
+		my_epfd = -1;
+	}
+}
+
+
+static void
+loop_init(void)
+{
+	if (my_epfd >= 0) {
+		return;
+	}
+	if ((my_epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		util_fatal("epoll_create1: %s", strerror(errno));
+	}
+	atexit(loop_cleanup);
+}
+
+
+/*
+ * Tell epoll what all live watches on fd want together
+ */
+
+static void
+loop_register(int fd, int known)
+{
+	struct epoll_event evt;
+	loop_watch_t *watch;
+	int count = 0;
+
+	memset(&evt, '\0', sizeof(evt));
+	evt.data.fd = fd;
+	for (watch = my_watches; watch != NULL; watch = watch->next) {
+		if (watch->fd == fd && watch->dead == 0) {
+			evt.events |= watch->events;
+			count++;
+		}
+	}
+
+	if (count == 0) {
+		epoll_ctl(my_epfd, EPOLL_CTL_DEL, fd, NULL);	// the fd may be closed already
+		return;
+	}
+	if (epoll_ctl(my_epfd, known ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &evt) < 0) {
+		util_error(__func__, __LINE__, "epoll_ctl(%d): %s", fd, strerror(errno));
+	}
+}
+
+
+loop_watch_t *
+loop_watch_add(int fd, unsigned int events, void (*callback)(int fd, unsigned int events, void *data), void *data)
+{
+	loop_watch_t *watch, *run;
+	int known = 0;
+
+	loop_init();
+	for (run = my_watches; run != NULL; run = run->next) {
+		known |= (run->fd == fd && run->dead == 0);
+	}
+
+	watch = util_malloc(sizeof(loop_watch_t));
+	watch->fd       = fd;
+	watch->events   = events;
+	watch->callback = callback;
+	watch->data     = data;
+	watch->next     = my_watches;
+	my_watches      = watch;
+
+	loop_register(fd, known);
+
+	return watch;
+}
+
+
+void
+loop_watch_update(loop_watch_t *watch, unsigned int events)
+{
+	watch->events = events;
+	loop_register(watch->fd, 1);
+}
+
+
+void
+loop_watch_free(loop_watch_t *watch)
+{
+	if (watch != NULL && watch->dead == 0) {
+		watch->dead = 1;
+		loop_register(watch->fd, 1);
+	}
+}
+
+
+loop_timer_t *
+loop_timer_add(uint64_t due, void (*callback)(void *data), void *data)
+{
+	loop_timer_t *timer;
+
+	loop_init();
+	timer = util_malloc(sizeof(loop_timer_t));
+	timer->due      = due;
+	timer->callback = callback;
+	timer->data     = data;
+	timer->next     = my_timers;
+	my_timers       = timer;
+
+	return timer;
+}
+
+
+void
+loop_timer_set(loop_timer_t *timer, uint64_t due)
+{
+	timer->due = due;
+}
+
+
+void
+loop_timer_free(loop_timer_t *timer)
+{
+	if (timer != NULL) {
+		timer->dead = 1;
+	}
+}
+
+
+void
+loop_quit(void)
+{
+	my_quit = 1;
+}
+
+
+static void
+loop_sweep(void)
+{
+	loop_watch_t **wpos, *watch;
+	loop_timer_t **tpos, *timer;
+
+	for (wpos = &my_watches; (watch = *wpos) != NULL; ) {
+		if (watch->dead) {
+			*wpos = watch->next;
+			util_free(watch);
+		} else {
+			wpos = &watch->next;
+		}
+	}
+	for (tpos = &my_timers; (timer = *tpos) != NULL; ) {
+		if (timer->dead) {
+			*tpos = timer->next;
+			util_free(timer);
+		} else {
+			tpos = &timer->next;
+		}
+	}
+}
+
+
+/*
+ * Timers fire once, they have to be set again to repeat
+ */
+
+static uint64_t
+loop_fire_timers(uint64_t deadline)
+{
+	loop_timer_t *timer;
+	uint64_t now, next;
+
+	now = loop_now();
+	for (timer = my_timers; timer != NULL; timer = timer->next) {
+		if (timer->dead == 0 && timer->due != 0 && timer->due <= now) {
+			timer->due = 0;
+			timer->callback(timer->data);
+		}
+	}
+
+	for (timer = my_timers, next = deadline; timer != NULL; timer = timer->next) {
+		if (timer->dead == 0 && timer->due != 0 && (next == 0 || timer->due < next)) {
+			next = timer->due;
+		}
+	}
+
+	return next;
+}
+
+
+static void
+loop_dispatch(int fd, unsigned int events)
+{
+	loop_watch_t *watch;
+	unsigned int mine;
+
+	for (watch = my_watches; watch != NULL; watch = watch->next) {
+		if (watch->fd != fd || watch->dead) {
+			continue;
+		}
+		if ((mine = events & (watch->events | EPOLLERR | EPOLLHUP)) != 0) {
+			watch->callback(fd, mine, watch->data);
+		}
+	}
+}
+
+
+/*
+ * Run until a callback calls loop_quit(), done() says so or the deadline
+ * (loop_now() based, 0 for none) has passed. Returns 0 at the deadline.
+ */
+
+int
+loop_run(uint64_t deadline, int (*done)(void))
+{
+	struct epoll_event events[LOOP_EVENTS];
+	uint64_t next, now;
+	int ret, idx, wait;
+
+	loop_init();
+	my_quit = 0;
+
+	for (;;) {
+		next = loop_fire_timers(deadline);
+		loop_sweep();
+		if (my_quit || (done != NULL && done())) {
+			return 1;
+		}
+
+		now = loop_now();
+		if (deadline != 0 && now >= deadline) {
+			return 0;
+		}
+		wait = (next == 0) ? -1 : (next > now) ? (int) ((next - now + 999) / 1000) : 0;
+
+		if ((ret = epoll_wait(my_epfd, events, LOOP_EVENTS, wait)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			util_fatal("epoll_wait: %s", strerror(errno));
+		}
+		for (idx = 0; idx < ret; idx++) {
+			loop_dispatch(events[idx].data.fd, events[idx].events);
+		}
+		loop_sweep();
+	}
+}
@@ -30,32 +30,47 @@
 #include "config.h"
 
 #include <getopt.h>
-#include <poll.h>
+#include <sys/epoll.h>
 
 
 #define VERSION		"2.4.2"
 #define LOG_FILE	"/tmp/zeroconf_lookup.log"
 
+#define FRAME_MAX	(1024 * 1024)	// limit for messages to the browser
+#define FRAME_RESERVE	4096		// room for epilog and next token
+#define ENTRY_SIZE	32768
+
 
 static struct option long_options[] = {
+	{ "rcvbuf",    required_argument, NULL, 'b' },
 	{ "force",     required_argument, NULL, 'f' },
 	{ "google",    required_argument, NULL, 'g' },
 	{ "help",      no_argument,       NULL, 'h' },
 	{ "install",   no_argument,       NULL, 'i' },
+	{ "json",      required_argument, NULL, 'j' },
 	{ "mozilla",   required_argument, NULL, 'm' },
 	{ "log",       no_argument,       NULL, 'l' },
 	{ "readable",  no_argument,       NULL, 'r' },
+	{ "stats",     no_argument,       NULL, 's' },
 	{ "timeout",   required_argument, NULL, 't' },
+	{ "trace",     required_argument, NULL, 'T' },
 	{ "uninstall", no_argument,       NULL, 'u' },
 	{ "verbose",   no_argument,       NULL, 'v' },
 	{ NULL, 0, NULL, 0 }
 };
 
-static char     my_input[64];
+static char     my_input[4096];
 static length_t my_length;
 static size_t   my_length_offset = 0;
 static size_t   my_input_offset;
 
+static char    *my_frame      = NULL;
+static size_t   my_frame_len  = 0;
+static size_t   my_frame_size = 0;
+
+static char     my_stats[8192];
+static int      my_show_stats = 0;
+
 
 static void
 main_usage(char *name, int retval)
@@ -65,18 +80,24 @@ main_usage(char *name, int retval)
 	fprintf(fp, "\n");
 	fprintf(fp, "Railduino zeroconf_lookup Version %s\n", VERSION);
 	fprintf(fp, "Usage: %s [options ...]\n", name);
-	fprintf(fp, "      -f|--force=<avahi|query>   Enforce query method\n");
+	fprintf(fp, "      -b|--rcvbuf=<bytes>        Set receive buffer of the mDNS socket\n");
+	fprintf(fp, "                                     Default: 262144\n");
+	fprintf(fp, "      -f|--force=<method>        Enforce query method: avahi, query or both (race them)\n");
 	fprintf(fp, "                                     Default: empty (use avahi if available, else query)\n");
 	fprintf(fp, "      -g|--google=<tag>          Change Google Chrome/Chromium allowed_origins\n");
 	fprintf(fp, "                                     Default: %s\n", GOOGLE_TAG);
 	fprintf(fp, "      -h|--help                  Display this usage information and exit\n");
 	fprintf(fp, "      -i|--install               Install Firefox/Chrome manifests (sudo for system wide)\n");
+	fprintf(fp, "      -j|--json=<request>        Use this request instead of reading it from stdin\n");
+	fprintf(fp, "                                     Example: '{\"cmd\":\"Lookup\",\"name\":\"LG-*\",\"max\":1}'\n");
 	fprintf(fp, "      -m|--mozilla=<tag>         Change Mozilla Firefox allowed_extensions\n");
 	fprintf(fp, "                                     Default: %s\n", MOZILLA_TAG);
 	fprintf(fp, "      -l|--log                   Write logfile (%s)\n", LOG_FILE);
 	fprintf(fp, "      -r|--readable              Use human readable length for output\n");
+	fprintf(fp, "      -s|--stats                 Print discovery counters to stderr when done\n");
 	fprintf(fp, "      -t|--timeout=<num>         Set query timeout\n");
 	fprintf(fp, "                                     Default: %s sec)\n", TIME_OUT);
+	fprintf(fp, "      -T|--trace=<file>          Write Chrome trace events (about://tracing, Perfetto)\n");
 	fprintf(fp, "      -u|--uninstall             Uninstall Firefox/Chrome manifests (sudo for system wide)\n");
 	fprintf(fp, "      -v|--verbose               Increase verbosity level\n");
 	fprintf(fp, "\n");
@@ -89,7 +110,7 @@ static int
 main_input_byte(char chr)
 {
 	if (my_length_offset < sizeof(my_length.as_uint)) {
-		util_debug(1, "got length byte %d = %02x", my_length_offset, (int) chr & 0xff);
+		util_debug(1, "got length byte %zu = %02x", my_length_offset, (int) chr & 0xff);
 		memset(my_input, '\0', sizeof(my_input));
 		my_input_offset = 0;
 		my_length.as_char[my_length_offset++] = chr;
@@ -106,15 +127,15 @@ main_input_byte(char chr)
 
 	if (my_input_offset < my_length.as_uint) {
 		if (chr > 0x20 && chr < 0x7f) {
-			util_debug(1, "got message byte %2u = %c",   my_input_offset, chr);
+			util_debug(1, "got message byte %2zu = %c",  my_input_offset, chr);
 		} else {
-			util_debug(1, "got message byte %2u = %02x", my_input_offset, (int) chr & 0xff);
+			util_debug(1, "got message byte %2zu = %02x", my_input_offset, (int) chr & 0xff);
 		}
 		my_input[my_input_offset] = chr;
 	}
 
 	if (++my_input_offset == my_length.as_uint) {
-		util_info("input complete: '%s'", util_strtrim(my_input, "\""));
+		util_info("input complete: '%s'", my_input);
 		return 1;
 	}
 
@@ -122,55 +143,194 @@ main_input_byte(char chr)
 }
 
 
+static void
+main_stdin_readable(int fd, unsigned int events, void *data)
+{
+	ssize_t ret;
+	char temp;
+
+	(void) events;
+	(void) data;
+
+	if ((ret = read(fd, &temp, 1)) != 1) {
+		util_fatal("can't read stdin (%s)", ret == 0 ? "closed" : strerror(errno));
+	}
+	if (main_input_byte(temp) == 1) {
+		loop_quit();
+	}
+}
+
+
 static void
 main_receive_input(void)
 {
-	util_debug(1, "awaiting input (poll), 5 sec max");
-	for (;;) {
-		struct pollfd fds[1];
-		int ret;
-		char temp;
-
-		fds[0].fd = STDIN_FILENO;
-		fds[0].events = POLLIN;
-		if ((ret = poll(fds, 1, 5000)) == -1) {
-			util_fatal("can't poll stdin (%s)", strerror(errno));
-		}
-		if (ret == 0) {
-			util_fatal("timeout on stdin");
-		}
+	loop_watch_t *watch;
 
-		if (fds[0].revents & POLLIN) {
-			read(fileno(stdin), &temp, 1);
-			if (main_input_byte(temp) == 1) {
-				return;
-			}
-		}
+	util_debug(1, "awaiting input (loop), 5 sec max");
+	watch = loop_watch_add(STDIN_FILENO, EPOLLIN, main_stdin_readable, NULL);
+	if (loop_run(loop_now() + 5000000, NULL) == 0) {
+		util_fatal("timeout on stdin");
 	}
+	loop_watch_free(watch);
 }
 
 
 static void
-main_send_result(char *source, int readable, result_t *result)
+main_frame_append(const char *str)
+{
+	size_t len = strlen(str), size;
+
+	if (my_frame_len + len + 1 > my_frame_size) {
+		size = (my_frame_size + len + 1) * 2;
+		my_frame = util_realloc(my_frame, size, my_frame_size);
+		my_frame_size = size;
+	}
+
+	memcpy(my_frame + my_frame_len, str, len + 1);
+	my_frame_len += len;
+}
+
+
+/*
+ * The Stats command returns the counters as one string in text exposition format
+ */
+
+static void
+main_append_stats(int compact)
 {
-	char prolog[1024], *epilog;
+	static char escaped[2 * sizeof(my_stats)];
+
+	stats_format(my_stats, sizeof(my_stats));
+	util_json_escape(escaped, sizeof(escaped), my_stats);
+
+	main_frame_append(compact ? ",\"stats\":\"" : ",\n  \"stats\": \"");
+	main_frame_append(escaped);
+	main_frame_append("\"");
+}
+
+
+/*
+ * The Types command returns the service types found as a list of strings
+ */
+
+static void
+main_append_types(int compact)
+{
+	static char types[8192];
+
+	result_format_types(types, sizeof(types), compact);
+
+	main_frame_append(compact ? ",\"types\":" : ",\n  \"types\": ");
+	main_frame_append(types);
+}
+
+
+/*
+ * A backend that found nothing lets the next one try. For Types there
+ * are no results, only the list of types.
+ */
+
+static int
+main_found(result_t *result)
+{
+	return result != NULL || result_get_type_count() > 0;
+}
+
+
+/*
+ * Format one entry. An entry that doesn't fit loses TXT records from the
+ * end until it does, a cut in the middle would break the JSON. Returns
+ * 0 if it can't be sent at all.
+ */
+
+static int
+main_format_entry(result_t *res, char *entry, size_t len, int compact)
+{
+	while (result_format(res, entry, len, compact) >= len - 1) {
+		if (result_trim_txt(res) == 0) {
+			util_error(__func__, __LINE__, "entry for %s too big, dropped", res->name);
+			return 0;
+		}
+		util_info("entry for %s too big, dropped a TXT record", res->name);
+	}
+	if (strlen(entry) + FRAME_RESERVE > FRAME_MAX) {
+		util_error(__func__, __LINE__, "entry for %s exceeds a frame, dropped", res->name);
+		return 0;
+	}
+
+	return 1;
+}
+
+
+/*
+ * Write one frame with as many entries as fit, starting at runner.
+ * Returns the first entry for the next frame, NULL after the last one.
+ */
+
+static result_t *
+main_send_frame(char *source, int readable, result_t *runner, int *total)
+{
+	static char entry[ENTRY_SIZE];
+	char buffer[4096], token[1024], escaped[2048];
+	int compact, count;
 	length_t length;
-	result_t *runner;
+	result_t *last;
+
+	compact = request_get_compact();
+
+	my_frame_len = 0;
+	if (compact) {
+		snprintf(buffer, sizeof(buffer), "{\"version\":2,\"source\":\"%s\",\"result\":[", source);
+	} else {
+		snprintf(buffer, sizeof(buffer), "{\n  \"version\": 2,\n  \"source\": \"%s\",\n  \"result\": [\n", source);
+	}
+	main_frame_append(buffer);
 
-	UTIL_STRCPY(prolog, "{\n  \"version\": 2,\n");
-	util_append(prolog, sizeof(prolog), "  \"source\": \"%s\",\n", source);
-	UTIL_STRCAT(prolog, "  \"result\": [\n");
-	length.as_uint = strlen(prolog);
+	*token = '\0';
+	for (last = NULL, count = 0; runner != NULL; runner = runner->next) {
+		if (main_format_entry(runner, entry, sizeof(entry), compact) == 0) {
+			continue;
+		}
+		if (count > 0 && my_frame_len + strlen(entry) + FRAME_RESERVE > FRAME_MAX) {
+			result_token(last, token, sizeof(token));
+			util_info("frame is full after %d results, next '%s'", count, token);
+			break;
+		}
 
-	for (runner = result; runner != NULL; runner = runner->next) {
-		length.as_uint += strlen(runner->text) + 1;
-		if (runner->next != NULL) {
-			length.as_uint += 1;
+		if (count > 0) {
+			main_frame_append(compact ? "," : ",\n");
 		}
+		main_frame_append(entry);
+		last = runner;
+		count++;
 	}
 
-	epilog = "  ]\n}\n";
-	length.as_uint += strlen(epilog);
+	timing_mark(TIMING_SERIALIZE);
+
+	if (compact) {
+		main_frame_append("]");
+	} else {
+		main_frame_append(count > 0 ? "\n  ]" : "  ]");
+	}
+	if (*token != '\0') {
+		util_json_escape(escaped, sizeof(escaped), token);
+		snprintf(buffer, sizeof(buffer), compact ? ",\"next\":\"%s\"" : ",\n  \"next\": \"%s\"", escaped);
+		main_frame_append(buffer);
+	} else {
+		// the extras go with the last frame only
+		if (request_get_timing()) {
+			timing_format(buffer, sizeof(buffer), compact);
+			main_frame_append(buffer);
+		}
+		if (strcmp(request_get_cmd(), "Stats") == 0) {
+			main_append_stats(compact);
+		}
+		if (strcmp(request_get_cmd(), "Types") == 0) {
+			main_append_types(compact);
+		}
+	}
+	main_frame_append(compact ? "}" : "\n}\n");
+	length.as_uint = (uint32_t) my_frame_len;
 
 	if (readable == 0) {
 		write(fileno(stdout), length.as_char, 4);
@@ -178,35 +338,117 @@ main_send_result(char *source, int readable, result_t *result)
 		printf("==> %u bytes <==\n", length.as_uint);
 	}
 
-	printf("%s", prolog);
-	for (runner = result; runner != NULL; runner = runner->next) {
-		printf("%s", runner->text);
-		printf("%s", runner->next != NULL ? ",\n" : "\n");
+	fwrite(my_frame, 1, my_frame_len, stdout);
+	fflush(stdout);
+
+	util_info("sent %u bytes with %d results", length.as_uint, count);
+	*total += count;
+
+	return runner;
+}
+
+
+/*
+ * Sort the results and skip the ones a previous frame had already sent,
+ * they come first in the sorted list
+ */
+
+static result_t *
+main_skip_sent(result_t *result, const char *after)
+{
+	result_t *runner;
+
+	if (result != NULL) {
+		result = result_sort();
+	}
+	for (runner = result; runner != NULL && result_after(runner, after) == 0; runner = runner->next) {
+		continue;
+	}
+
+	return runner;
+}
+
+
+/*
+ * The browser rejects messages bigger than FRAME_MAX. If the results
+ * don't fit, they go out in several frames from this one discovery, a
+ * port (connectNative) gets all of them. Each frame but the last ends
+ * with a "next" token, passed back as "continue" it resumes after the
+ * entries already received.
+ */
+
+static void
+main_send_result(char *source, int readable, result_t *result)
+{
+	char *after;
+	int frames, count;
+	result_t *runner;
+	uint64_t start;
+
+	after  = request_get_continue();
+	runner = main_skip_sent(result, after);
+
+	//
+	// A resume only probes the entries still to send. A probe may switch
+	// the URL to a faster address, so sort again afterwards.
+	//
+	if (runner != NULL && request_get_probe() != PROBE_NONE) {
+		probe_results(runner, request_get_probe());
+		if (request_get_drop()) {
+			result_drop_unreachable();
+		}
+		timing_mark(TIMING_PROBE);
+		runner = main_skip_sent(result_get_list(), after);
 	}
-	printf("%s", epilog);
 
-	fflush(stdout);
+	start = trace_now();
+
+	frames = count = 0;
+	do {
+		runner = main_send_frame(source, readable, runner, &count);
+		frames++;
+	} while (runner != NULL);
+
+	if (frames > 1) {
+		util_info("sent %d results in %d frames", count, frames);
+	}
+
+	timing_mark(TIMING_WRITE);
+	timing_log();
+	trace_complete(TRACE_LANE_MAIN, "main", "serialize", start, source, count);
+
+	if (my_show_stats) {
+		stats_format(my_stats, sizeof(my_stats));
+		fputs(my_stats, stderr);
+	}
 }
 
 
 int
 main(int argc, char *argv[])
 {
-	static char avahi[256], query[256], google[256], mozilla[256], timeout[32], force[32];
+	static char avahi[256], query[256], both[256], google[256], mozilla[256], timeout[32], force[32], rcvbuf[32];
+	static char request[4096], trace[1024];
 	int c, do_log, readable, do_inst, do_uninst;
 	result_t *result;
 
+	timing_mark(TIMING_START);
+
 	snprintf(avahi, sizeof(avahi), "Avahi (C, %s)", VERSION);
 	snprintf(query, sizeof(query), "Query (C, %s)", VERSION);
+	snprintf(both,  sizeof(both),  "Avahi+Query (C, %s)", VERSION);
 
 	do_log = readable = do_inst = do_uninst = 0;
 	for (;;) {
-		c = getopt_long(argc, argv, "f:g:h?im:lrt:uv", long_options, NULL);
+		c = getopt_long(argc, argv, "b:f:g:h?ij:m:lrst:T:uv", long_options, NULL);
 		if (c < 0) {
 			break;
 		}
 
 		switch (c) {
+			case 'b':
+				UTIL_STRCPY(rcvbuf, optarg);
+				break;
 			case 'f':
 				UTIL_STRCPY(force, optarg);
 				break;
@@ -220,6 +462,9 @@ main(int argc, char *argv[])
 			case 'i':
 				do_inst = 1;
 				break;
+			case 'j':
+				UTIL_STRCPY(request, optarg);
+				break;
 			case 'm':
 				UTIL_STRCPY(mozilla, optarg);
 				break;
@@ -229,9 +474,15 @@ main(int argc, char *argv[])
 			case 'r':
 				readable = 1;
 				break;
+			case 's':
+				my_show_stats = 1;
+				break;
 			case 't':
 				UTIL_STRCPY(timeout, optarg);
 				break;
+			case 'T':
+				UTIL_STRCPY(trace, optarg);
+				break;
 			case 'u':
 				do_uninst = 1;
 				break;
@@ -247,8 +498,11 @@ main(int argc, char *argv[])
 	if (do_log == 0 && do_inst == 0 && do_uninst == 0) {
 		util_open_logfile(LOG_FILE);
 	}
+	if (*trace != '\0') {
+		trace_open(trace);
+	}
 
-	config_read(google, mozilla, timeout, force);
+	config_read(google, mozilla, timeout, force, rcvbuf);
 
 	if (do_inst == 1 || do_uninst == 1) {
 		if (do_uninst == 1) {
@@ -260,8 +514,11 @@ main(int argc, char *argv[])
 		exit(EXIT_SUCCESS);
 	}
 
-	if (readable == 0) {
+	if (*request != '\0') {
+		request_parse(request);
+	} else if (readable == 0) {
 		main_receive_input();
+		request_parse(my_input);
 	}
 
 	if (strcmp(config_get_force(), "avahi") == 0) {
@@ -272,12 +529,17 @@ main(int argc, char *argv[])
 		main_send_result(query, readable, query_browse());
 		exit(EXIT_SUCCESS);
 	}
+	if (strcmp(config_get_force(), "both") == 0) {
+		main_send_result(both, readable, avahi_race());
+		exit(EXIT_SUCCESS);
+	}
 
-	if ((result = avahi_browse()) != NULL) {
+	if (main_found(result = avahi_browse())) {
 		main_send_result(avahi, readable, result);
 		exit(EXIT_SUCCESS);
 	}
-	if ((result = query_browse()) != NULL) {
+	timing_fallback();
+	if (main_found(result = query_browse())) {
 		main_send_result(query, readable, result);
 		exit(EXIT_SUCCESS);
 	}
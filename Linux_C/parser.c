@@ -35,10 +35,16 @@
  */
 
 static char err_buf[4096];
+static char err_reason[64];
+static int  unknown_cnt;
 
 static int label_ofs[256];
 static int label_cnt;
 
+static int msg_len;		// of the answer being parsed, nothing is read beyond
+
+#define RR_FIXED	10		// type, class, TTL and RDLENGTH after the name
+
 static uint16_t query_id = 0;
 
 
@@ -49,6 +55,8 @@ parser_set_error(const char *func, char *fmt, ...)
 	va_list ap;
 
 	snprintf(err_buf, sizeof(err_buf), "%s: ", func);
+	snprintf(err_reason, sizeof(err_reason), "%s",
+			strncmp(func, "parser_", 7) == 0 ? func + 7 : func);
 	ofs = strlen(err_buf);
 
 	va_start(ap, fmt);
@@ -64,25 +72,36 @@ parser_get_error(void)
 }
 
 
+/*
+ * Short name of the step that failed, e.g. "parse_name"
+ */
+
+char *
+parser_get_reason(void)
+{
+	return err_reason;
+}
+
+
+/*
+ * Records of the last answer that were skipped for their type
+ */
+
+int
+parser_get_unknown(void)
+{
+	return unknown_cnt;
+}
+
+
 size_t
 parser_create_query(char *data, size_t len, char *name, uint16_t qtype)
 {
 	DNS_HEADER *hdr;
-	DNS_QUESTION que;
-	char buf[DNS_NAME_SIZE], *src;
-	size_t ofs, siz;
 
 	memset(err_buf, '\0', sizeof(err_buf));
 
-	if (name == NULL || strlen(name) == 0) {
-		parser_set_error(__func__, "missing name");
-		return 0;
-	}
-	if (strlen(name) > (DNS_NAME_SIZE) - 2) {
-		parser_set_error(__func__, "name too long");
-		return 0;
-	}
-	if (len < (sizeof(DNS_HEADER) + strlen(name) + 6)) {
+	if (len < sizeof(DNS_HEADER)) {
 		parser_set_error(__func__, "buffer too small");
 		return 0;
 	}
@@ -92,15 +111,51 @@ parser_create_query(char *data, size_t len, char *name, uint16_t qtype)
 	hdr = (DNS_HEADER *) data;
 	hdr->msg_id      = htons(query_id);
 	hdr->msg_flags   = 0;
-	hdr->msg_qdcount = htons(1);
+	hdr->msg_qdcount = htons(0);
 	hdr->msg_ancount = htons(0);
 	hdr->msg_nscount = htons(0);
 	hdr->msg_arcount = htons(0);
 
-	ofs = sizeof(DNS_HEADER);
-	strncpy(buf, name, sizeof(buf));
+	return parser_add_question(data, len, sizeof(DNS_HEADER), name, qtype);
+}
+
+
+/**
+ * Append one more question to a query created by parser_create_query().
+ * Returns the new message length or 0 on error.
+ */
+
+size_t
+parser_add_question(char *data, size_t len, size_t ofs, char *name, uint16_t qtype)
+{
+	DNS_HEADER *hdr;
+	DNS_QUESTION que;
+	char buf[DNS_NAME_SIZE], *src;
+	size_t siz;
+
+	if (ofs == 0) {
+		return 0;	// previous call failed, keep its error
+	}
+	if (name == NULL || strlen(name) == 0) {
+		parser_set_error(__func__, "missing name");
+		return 0;
+	}
+	if (strlen(name) > (DNS_NAME_SIZE) - 2) {
+		parser_set_error(__func__, "name too long");
+		return 0;
+	}
+	if (len < (ofs + strlen(name) + 2 + sizeof(DNS_QUESTION))) {
+		parser_set_error(__func__, "buffer too small");
+		return 0;
+	}
+
+	UTIL_STRCPY(buf, name);
 	for (src = strtok(buf, "."); src != NULL; src = strtok(NULL, ".")) {
 		siz = strlen(src);
+		if (siz > 63) {
+			parser_set_error(__func__, "label too long");
+			return 0;
+		}
 		data[ofs++] = (char) siz;
 		memcpy(data + ofs, src, siz);
 		ofs += siz;
@@ -111,6 +166,9 @@ parser_create_query(char *data, size_t len, char *name, uint16_t qtype)
 	que.que_qclass = htons(DNS_CLASS_IN);
 	memcpy(data + ofs, &que, sizeof(DNS_QUESTION));
 
+	hdr = (DNS_HEADER *) data;
+	hdr->msg_qdcount = htons(ntohs(hdr->msg_qdcount) + 1);
+
 	return ofs + sizeof(DNS_QUESTION);
 }
 
@@ -126,23 +184,33 @@ parser_parse_name(char *data, int start, char *dst)
 	char *ptr;
 	int ofs, siz, final, num;
 
+	*dst = '\0';
 	for (ptr = dst, ofs = start, final = 0; ; ) {
-		memcpy(&jmp, data + ofs, sizeof(jmp));
-		jmp = ntohs(jmp);
-		if ((jmp & 0xc000) == 0xc000) {
+		if (ofs >= msg_len) {
+			parser_set_error(__func__, "name beyond message");
+			return -1;
+		}
+		if ((data[ofs] & 0xc0) == 0xc0) {
+			if (ofs + (int) sizeof(jmp) > msg_len) {
+				parser_set_error(__func__, "jump beyond message");
+				return -1;
+			}
+			memcpy(&jmp, data + ofs, sizeof(jmp));
+			jmp = ntohs(jmp) & 0x3fff;
 			if (final == 0) {
 				final = ofs + sizeof(jmp);
 			}
-			ofs = jmp & 0x3fff;
-			for (num = 0; num < label_cnt; num++) {
-				if (ofs == label_ofs[num]) {
+			// only backwards to a label seen before, no loops
+			for (num = 0; num < label_cnt && jmp < ofs; num++) {
+				if (jmp == label_ofs[num]) {
 					break;
 				}
 			}
-			if (num >= label_cnt) {
+			if (jmp >= ofs || num >= label_cnt) {
 				parser_set_error(__func__, "invalid jump target");
 				return -1;
 			}
+			ofs = jmp;
 			continue;
 		}
 
@@ -155,23 +223,26 @@ parser_parse_name(char *data, int start, char *dst)
 			parser_set_error(__func__, "label is too long");
 			return -1;
 		}
-		label_ofs[label_cnt++] = ofs;
-
-		if ((ofs + siz + 1) > (start + 255)) {
+		if (ofs + siz + 1 > msg_len) {
+			parser_set_error(__func__, "label beyond message");
+			return -1;
+		}
+		if ((ptr - dst) + siz + 2 > DNS_NAME_SIZE) {
 			parser_set_error(__func__, "name is too long");
 			return -1;
 		}
+		if (label_cnt < (int) (sizeof(label_ofs) / sizeof(label_ofs[0]))) {
+			label_ofs[label_cnt++] = ofs;
+		}
 
 		if (ptr != dst) {
 			*ptr++ = '.';
 		}
 		memcpy(ptr, data + ofs + 1, siz);
 		ptr += siz;
+		*ptr = '\0';
 		ofs += (siz + 1);
 	}
-
-	parser_set_error(__func__, "unfinished name");
-	return -1;
 }
 
 
@@ -223,7 +294,8 @@ parser_parse_rr_txt(char *data, int start, DNS_RR *rr)
 	char *ptr;
 
 	for (len = (int) rr->rr_rdlength, cnt = 0; len > 0 && cnt < TXT_MAX; ) {
-		if ((siz = (int) data[start]) == 0) {
+		// length bytes above 127 must not turn negative
+		if ((siz = (int) (unsigned char) data[start]) == 0 || siz >= len) {
 			break;
 		}
 		ptr = rr->rr.rr_txt.txt_data[cnt++];
@@ -266,6 +338,11 @@ parser_parse_rr_aaaa(char *data, size_t start, DNS_RR *rr)
 static int
 parser_parse_rr_srv(char *data, size_t start, DNS_RR *rr)
 {
+	if (rr->rr_rdlength < 3 * sizeof(uint16_t) + 1) {
+		parser_set_error(__func__, "SRV record too short (%d)", rr->rr_rdlength);
+		return -1;
+	}
+
 	memcpy(&(rr->rr.rr_srv.srv_prio), data + start, sizeof(rr->rr.rr_srv.srv_prio));
 	rr->rr.rr_srv.srv_prio = ntohs(rr->rr.rr_srv.srv_prio);
 	start += sizeof(rr->rr.rr_srv.srv_prio);
@@ -290,10 +367,13 @@ int
 parser_parse_answer(char *data, size_t len, DNS_RR *rr, int rr_size)
 {
 	DNS_HEADER hdr;
+	char qname[DNS_NAME_SIZE];
 	int num, cnt, start;
 
 	memset(err_buf, '\0', sizeof(err_buf));
+	memset(err_reason, '\0', sizeof(err_reason));
 	label_cnt = 0;
+	unknown_cnt = 0;
 
 	if (len < sizeof(DNS_HEADER)) {
 		parser_set_error(__func__, "buffer len too small for header");
@@ -327,12 +407,30 @@ parser_parse_answer(char *data, size_t len, DNS_RR *rr, int rr_size)
 		parser_set_error(__func__, "rr_size too small (need %d)", cnt);
 		return -1;
 	}
-	start = sizeof(DNS_HEADER);
+	start   = sizeof(DNS_HEADER);
+	msg_len = (int) len;
+
+	//
+	// Responses normally carry no questions, skip them if they do
+	//
+	for (num = 0; num < hdr.msg_qdcount; num++) {
+		if ((start = parser_parse_name(data, start, qname)) < 0) {
+			return -1;
+		}
+		if ((start += sizeof(DNS_QUESTION)) > msg_len) {
+			parser_set_error(__func__, "question beyond message");
+			return -1;
+		}
+	}
 
 	for (num = 0; num < cnt; num++, rr++) {
 		memset(rr, '\0', sizeof(DNS_RR));
 
-		if ((start = parser_parse_name(data, start, rr->rr_name)) == 0) {
+		if ((start = parser_parse_name(data, start, rr->rr_name)) < 0) {
+			return -1;
+		}
+		if (start + RR_FIXED > msg_len) {
+			parser_set_error(__func__, "record header beyond message");
 			return -1;
 		}
 
@@ -352,6 +450,11 @@ parser_parse_answer(char *data, size_t len, DNS_RR *rr, int rr_size)
 		rr->rr_rdlength = ntohs(rr->rr_rdlength);
 		start += sizeof(rr->rr_rdlength);
 
+		if (start + rr->rr_rdlength > msg_len) {
+			parser_set_error(__func__, "record data beyond message (%d bytes)", rr->rr_rdlength);
+			return -1;
+		}
+
 		switch (rr->rr_type) {
 			case DNS_RR_TYPE_A:
 				if (parser_parse_rr_a(data, start, rr) == -1) {
@@ -379,8 +482,9 @@ parser_parse_answer(char *data, size_t len, DNS_RR *rr, int rr_size)
 				}
 				break;
 			default:
-				parser_set_error(__func__, "invalid RR-Type 0x%02x", rr->rr_type);
-				return -1;
+				// e.g. NSEC or HINFO, skipped but kept in the list
+				unknown_cnt++;
+				break;
 		}
 		start += rr->rr_rdlength;
 	}
@@ -168,7 +168,10 @@ typedef struct {
  */
 
 char *parser_get_error(void);
+char *parser_get_reason(void);
+int parser_get_unknown(void);
 size_t parser_create_query(char *data, size_t len, char *name, uint16_t qtype);
+size_t parser_add_question(char *data, size_t len, size_t ofs, char *name, uint16_t qtype);
 int parser_parse_answer(char *data, size_t len, DNS_RR *rr, int rr_size);
 
 #endif /* !_PARSER_H */
@@ -0,0 +1,423 @@
+/****************************************************************************
+ *
+ * Copyright (c) 2017-2018 Volker Wiegand <volker@railduino.de>
+ *
+ * This file is part of Zeroconf-Lookup.
+ * Project home: https://www.railduino.de/zeroconf-lookup
+ * Source code:  https://github.com/railduino/zeroconf-lookup.git
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ ****************************************************************************/
+
+#include "common.h"
+
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <strings.h>
+
+
+
+#define PROBE_STAGGER	100		// ms between racing attempts (RFC 8305 minimum)
+
+
+/*
+ * Optional stage after discovery: every URL gets a non-blocking TCP
+ * connect (and maybe a "HEAD /") at the same time, all of them share
+ * one deadline. Stale announcements of switched-off devices end up
+ * with "reachable": false instead of a browser timeout later.
+ *
+ * In race mode all addresses of an entry compete like in RFC 8305:
+ * the attempts start PROBE_STAGGER apart (the next one at once if one
+ * fails) and the first handshake makes the URL. The other addresses are
+ * then started right away to measure them, but only for PROBE_STAGGER
+ * after the last entry was settled.
+ */
+
+enum {
+	PROBE_IDLE = 0,
+	PROBE_CONNECTING,
+	PROBE_WAITING,		// HEAD sent, waiting for the status line
+	PROBE_FINISHED
+};
+
+
+typedef struct {
+	result_t	*res;
+	addr_t		*addr;
+	int		fd;
+	loop_watch_t	*watch;
+	int		state;
+	uint64_t	due;		// loop_now() when to start
+	uint64_t	start;		// trace_now() when the connect began
+	char		status[64];	// start of the HEAD answer
+	size_t		got;
+} probe_t;
+
+
+static probe_t      *my_probes   = NULL;
+static int           my_count    = 0;
+static int           my_mode     = PROBE_NONE;
+static loop_timer_t *my_timer    = NULL;
+static uint64_t      my_deadline = 0;
+static uint64_t      my_settled  = 0;	// loop_now() when every entry was decided
+
+
+static void probe_event(int fd, unsigned int events, void *data);	// probe_start() arms it
+
+
+static void
+probe_close(probe_t *prb)
+{
+	loop_watch_free(prb->watch);
+	prb->watch = NULL;
+	if (prb->fd >= 0) {
+		close(prb->fd);
+		prb->fd = -1;
+	}
+	prb->state = PROBE_FINISHED;
+}
+
+
+/*
+ * An entry is dead once none of its attempts is left
+ */
+
+static void
+probe_settle(result_t *res)
+{
+	int num;
+
+	if (res->reachable != -1) {
+		return;
+	}
+	for (num = 0; num < my_count; num++) {
+		if (my_probes[num].res == res && my_probes[num].state != PROBE_FINISHED) {
+			return;
+		}
+	}
+
+	res->reachable = 0;
+	util_debug(1, "probe %s: dead", res->url);
+}
+
+
+static void
+probe_failed(probe_t *prb, const char *reason)
+{
+	probe_t *nxt;
+
+	util_debug(1, "probe %s [%s]: %s", prb->res->url, prb->addr->text, reason);
+	trace_complete(trace_responder(prb->addr->text), "probe", "dead", prb->start, prb->addr->text, 0);
+	probe_close(prb);
+
+	//
+	// A failed attempt doesn't wait for the stagger, the next one starts now
+	//
+	for (nxt = prb + 1; nxt < my_probes + my_count && nxt->res == prb->res; nxt++) {
+		if (nxt->state == PROBE_IDLE) {
+			nxt->due = loop_now();
+			break;
+		}
+	}
+
+	probe_settle(prb->res);
+}
+
+
+static void
+probe_success(probe_t *prb)
+{
+	double msec = (trace_now() - prb->start) / 1000.0;
+	probe_t *nxt;
+
+	trace_complete(trace_responder(prb->addr->text), "probe", "reachable", prb->start, prb->addr->text, 1);
+	probe_close(prb);
+
+	if (my_mode == PROBE_RACE) {
+		prb->addr->rtt_ms = msec;
+	}
+	if (prb->res->reachable != -1) {
+		return;		// only measured
+	}
+
+	prb->res->reachable  = 1;
+	prb->res->connect_ms = msec;
+	if (prb->addr != prb->res->addrs) {
+		result_prefer_address(prb->res, prb->addr);
+	}
+	util_debug(1, "probe %s: reachable (%.3f ms)", prb->res->url, msec);
+
+	for (nxt = my_probes; nxt < my_probes + my_count; nxt++) {
+		if (nxt->res == prb->res && nxt->state == PROBE_IDLE) {
+			nxt->due = loop_now();
+		}
+	}
+}
+
+
+static void
+probe_start(probe_t *prb)
+{
+	struct sockaddr_storage addr;
+	struct sockaddr_in  *sin  = (struct sockaddr_in *)  &addr;
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &addr;
+	socklen_t len;
+
+	memset(&addr, '\0', sizeof(addr));
+	prb->start = trace_now();
+	if (inet_pton(AF_INET, prb->addr->text, &sin->sin_addr) == 1) {
+		sin->sin_family = AF_INET;
+		sin->sin_port   = htons(prb->res->port);
+		len = sizeof(*sin);
+	} else if (inet_pton(AF_INET6, prb->addr->text, &sin6->sin6_addr) == 1) {
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port   = htons(prb->res->port);
+		if (prb->addr->iface[0] != '\0') {
+			sin6->sin6_scope_id = if_nametoindex(prb->addr->iface);
+		}
+		len = sizeof(*sin6);
+	} else {
+		probe_failed(prb, "not an address");
+		return;
+	}
+
+	if ((prb->fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+		util_error(__func__, __LINE__, "socket: %s", strerror(errno));
+		probe_failed(prb, strerror(errno));
+		return;
+	}
+	if (connect(prb->fd, (struct sockaddr *) &addr, len) < 0 && errno != EINPROGRESS) {
+		probe_failed(prb, strerror(errno));
+		return;
+	}
+
+	prb->watch = loop_watch_add(prb->fd, EPOLLOUT, probe_event, prb);
+	prb->state = PROBE_CONNECTING;
+}
+
+
+static void
+probe_connected(probe_t *prb)
+{
+	char request[512];
+	const char *addr = prb->addr->text;
+	int err = 0, len;
+	socklen_t siz = sizeof(err);
+
+	getsockopt(prb->fd, SOL_SOCKET, SO_ERROR, &err, &siz);
+	if (err != 0) {
+		probe_failed(prb, strerror(err));
+		return;
+	}
+
+	//
+	// There is no TLS here, an https server only gets the handshake
+	//
+	if (my_mode != PROBE_HEAD || strncmp(prb->res->url, "https:", 6) == 0) {
+		probe_success(prb);
+		return;
+	}
+	prb->res->connect_ms = (trace_now() - prb->start) / 1000.0;
+
+	//
+	// The request is tiny, it always fits into the fresh socket buffer
+	//
+	len = snprintf(request, sizeof(request), "HEAD / HTTP/1.0\r\nHost: %s%s%s:%d\r\nConnection: close\r\n\r\n",
+			strchr(addr, ':') ? "[" : "", addr, strchr(addr, ':') ? "]" : "", prb->res->port);
+	if (send(prb->fd, request, len, MSG_NOSIGNAL) != len) {
+		probe_failed(prb, "can't send HEAD");
+		return;
+	}
+
+	loop_watch_update(prb->watch, EPOLLIN);
+	prb->got   = 0;
+	prb->state = PROBE_WAITING;
+}
+
+
+/*
+ * Any HTTP status line counts, even 404 means a server is there.
+ * It may come in pieces, so wait for the end of the line (or enough of
+ * it) until the probe deadline; only a wrong prefix or a close fails.
+ */
+
+static void
+probe_answered(probe_t *prb)
+{
+	double msec;
+	ssize_t cnt;
+	size_t cmp;
+
+	cnt = recv(prb->fd, prb->status + prb->got, sizeof(prb->status) - 1 - prb->got, 0);
+	if (cnt < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		return;
+	}
+	if (cnt <= 0) {
+		probe_failed(prb, (cnt == 0) ? "closed before the status line" : "no HTTP answer");
+		return;
+	}
+	prb->got += cnt;
+	prb->status[prb->got] = '\0';
+
+	cmp = (prb->got < 5) ? prb->got : 5;
+	if (strncmp(prb->status, "HTTP/", cmp) != 0) {
+		probe_failed(prb, "no HTTP answer");
+		return;
+	}
+	if (prb->got < 5 || (strchr(prb->status, '\n') == NULL && prb->got < sizeof(prb->status) - 1)) {
+		return;		// more to come
+	}
+
+	msec = prb->res->connect_ms;
+	probe_success(prb);
+	prb->res->connect_ms = msec;	// the handshake, not the HEAD round trip
+}
+
+
+static int
+probe_unsettled(void)
+{
+	int num, count;
+
+	for (num = 0, count = 0; num < my_count; num++) {
+		count += (my_probes[num].res->reachable == -1 && my_probes[num].state != PROBE_FINISHED);
+	}
+
+	return count;
+}
+
+
+/*
+ * Start what is due and arm the timer for the next attempt, or for
+ * the end of the measuring grace once every entry is decided
+ */
+
+static void
+probe_schedule(void *data)
+{
+	uint64_t now, next;
+	probe_t *prb;
+	int pending;
+
+	(void) data;
+
+	now = loop_now();
+	for (prb = my_probes, pending = 0; prb < my_probes + my_count; prb++) {
+		if (prb->state == PROBE_IDLE && prb->due <= now) {
+			probe_start(prb);
+		}
+		pending += (prb->state != PROBE_FINISHED);
+	}
+	if (my_settled == 0 && probe_unsettled() == 0) {
+		my_settled = now;
+	}
+	if (pending == 0 || (my_settled != 0 && now >= my_settled + PROBE_STAGGER * 1000)) {
+		loop_quit();
+		return;
+	}
+
+	next = (my_settled != 0) ? my_settled + PROBE_STAGGER * 1000 : my_deadline;
+	for (prb = my_probes; prb < my_probes + my_count; prb++) {
+		if (prb->state == PROBE_IDLE && prb->due < next) {
+			next = prb->due;
+		}
+	}
+	loop_timer_set(my_timer, next);
+}
+
+
+static void
+probe_event(int fd, unsigned int events, void *data)
+{
+	probe_t *prb = data;
+
+	(void) fd;
+	(void) events;
+
+	if (prb->state == PROBE_CONNECTING) {
+		probe_connected(prb);
+	} else if (prb->state == PROBE_WAITING) {
+		probe_answered(prb);
+	}
+	probe_schedule(NULL);	// a failure may have made the next attempt due
+}
+
+
+void
+probe_results(result_t *list, int mode)
+{
+	probe_t *prb;
+	result_t *run;
+	addr_t *addr;
+	int count, pending, tries;
+
+	for (run = list, count = 0; run != NULL; run = run->next) {
+		for (addr = run->addrs; addr != NULL; addr = addr->next) {
+			count++;
+			if (mode != PROBE_RACE) {
+				break;		// just the one in the URL
+			}
+		}
+	}
+	if (count == 0) {
+		return;
+	}
+
+	my_mode     = mode;
+	my_probes   = util_malloc(count * sizeof(probe_t));
+	my_deadline = loop_now() + (uint64_t) config_get_probe() * 1000;
+	my_settled  = 0;
+	util_info("probe %d addresses (%s, %d ms)", count,
+			mode == PROBE_HEAD ? "HEAD" : mode == PROBE_RACE ? "race" : "connect", config_get_probe());
+
+	for (run = list, my_count = 0; run != NULL; run = run->next) {
+		for (addr = run->addrs, tries = 0; addr != NULL && (mode == PROBE_RACE || tries == 0); addr = addr->next, tries++) {
+			prb = &my_probes[my_count++];
+			prb->res  = run;
+			prb->addr = addr;
+			prb->fd    = -1;
+			prb->watch = NULL;
+			prb->state = PROBE_IDLE;
+			prb->due   = loop_now() + (uint64_t) tries * PROBE_STAGGER * 1000;
+		}
+	}
+
+	my_timer = loop_timer_add(loop_now(), probe_schedule, NULL);
+	loop_run(my_deadline, NULL);
+	loop_timer_free(my_timer);
+	my_timer = NULL;
+
+	//
+	// Whatever is still open at the deadline counts as dead
+	//
+	if ((pending = probe_unsettled()) > 0) {
+		util_info("probe deadline reached, %d addresses did not answer", pending);
+	}
+	for (prb = my_probes; prb < my_probes + my_count; prb++) {
+		probe_close(prb);
+	}
+	for (prb = my_probes; prb < my_probes + my_count; prb++) {
+		probe_settle(prb->res);
+	}
+
+	util_free(my_probes);
+	my_probes = NULL;
+	my_count  = 0;
+}
@@ -26,231 +26,952 @@
  *
  ****************************************************************************/
 
+#define _GNU_SOURCE		// struct in6_pktinfo (RFC 3542)
+
 #include "common.h"
 #include "parser.h"
 
-#include <poll.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 
 
-#define MDNS_SIZE	4096
-#define QUERY_NAME	"_http._tcp.local"
+#define MDNS_SIZE	9000		// RFC 6762 allows multicast replies up to 9000 bytes
+#define QUERY_RRS	128		// resource records per packet
+#define QUERY_SERVICES	"_services._dns-sd._udp.local"	// RFC 6763 section 9
 
 #define INADDR_MDNS	"224.0.0.251"
+#define IN6ADDR_MDNS	"ff02::fb"
 #define MDNS_PORT	5353
+#define MDNS_TTL	255		// RFC 6762 section 11
+
+
+#define QUERY_IFACES	32
+#define QUERY_BATCH	16		// datagrams per recvmmsg() call
+#define QUERY_CONTROL	(CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(struct in6_pktinfo)))
 
 
-static result_t *my_results = NULL;
+/*
+ * One socket per address family is bound to the group and joined on every
+ * allowed interface; PKTINFO tells which interface an answer arrived on,
+ * MULTICAST_IF selects the interface for each copy of the question.
+ */
+
 static int       my_sock    = 0;
+static int       my_sock6   = 0;
+static iface_t   my_ifaces[QUERY_IFACES];
+static int       my_iface_cnt = 0;
+static uint32_t  my_drops[2];		// SO_RXQ_OVFL per socket
+static uint64_t  my_deadline;		// loop_now(), one window for all interfaces
+static loop_watch_t *my_watch  = NULL;
+static loop_watch_t *my_watch6 = NULL;
+static const char *my_receive = "recvmsg";	// the path in use, see query_receive()
+static unsigned long my_packets = 0;
+static double    my_cpu_ms = 0.0;		// at query_start()
 
 
 static void
 query_cleanup(void)
 {
-	struct ip_mreq mreq;
-	result_t *result;
+	struct ip_mreqn mreq;
+	struct ipv6_mreq mreq6;
+	int idx;
 
 	if (my_sock > 0) {
-		mreq.imr_multiaddr.s_addr = inet_addr(INADDR_MDNS);
-		mreq.imr_interface.s_addr = htonl(INADDR_ANY);
-		setsockopt(my_sock, IPPROTO_IP, IP_DROP_MEMBERSHIP, &mreq, sizeof(mreq));
+		for (idx = 0; idx < my_iface_cnt; idx++) {
+			memset(&mreq, '\0', sizeof(mreq));
+			mreq.imr_multiaddr.s_addr = inet_addr(INADDR_MDNS);
+			mreq.imr_ifindex          = my_ifaces[idx].index;
+			setsockopt(my_sock, IPPROTO_IP, IP_DROP_MEMBERSHIP, &mreq, sizeof(mreq));
+		}
 
 		close(my_sock);
 		my_sock = 0;
 	}
 
-	while (my_results != NULL) {
-		result = my_results->next;
-		util_free(my_results->text);
-		util_free(my_results);
-		my_results = result;
+	if (my_sock6 > 0) {
+		for (idx = 0; idx < my_iface_cnt; idx++) {
+			inet_pton(AF_INET6, IN6ADDR_MDNS, &mreq6.ipv6mr_multiaddr);
+			mreq6.ipv6mr_interface = my_ifaces[idx].index;
+			setsockopt(my_sock6, IPPROTO_IPV6, IPV6_LEAVE_GROUP, &mreq6, sizeof(mreq6));
+		}
+
+		close(my_sock6);
+		my_sock6 = 0;
 	}
 }
 
 
+static txt_t *
+query_txt_list(DNS_RR_TXT *txt)
+{
+	txt_t *head, *tail, *ptr;
+	int num;
+
+	if (txt == NULL) {
+		return NULL;
+	}
+
+	for (num = 0, head = tail = NULL; num < txt->txt_cnt; num++) {
+		ptr = util_malloc(sizeof(txt_t));
+		UTIL_STRCPY(ptr->text, txt->txt_data[num]);
+		if (tail == NULL) {
+			tail = (head = ptr);
+		} else {
+			tail = (tail->next = ptr);
+		}
+	}
+
+	return head;
+}
+
+
 static void
-query_read_answer(void)
+query_add_result(result_t *result)
 {
-	char buf[MDNS_SIZE], url[MDNS_SIZE], answer[MDNS_SIZE];
-	struct sockaddr_storage addr;
-	socklen_t len;
-	int cnt, res, num, port;
-	DNS_RR rrs[10], *rrp;
+	result->source = RESULT_QUERY;
+	if (result_add(result) == 1) {
+		util_info("query found %s for %s", result->url, result->name);
+	}
+}
+
+
+/*
+ * Split an owner name like "Instance._http._tcp.local" into the
+ * instance and its service type. Returns the type, or NULL (and name
+ * untouched) if it is none of the types asked for. Instance names may
+ * contain dots, so only the suffix counts.
+ */
+
+static const char *
+query_instance_type(char *name)
+{
+	const char *types[REQUEST_TYPES];
+	char suffix[DNS_NAME_SIZE];
+	size_t len, siz;
+	int num, idx;
+
+	num = request_get_types(types, REQUEST_TYPES);
+	len = strlen(name);
+	for (idx = 0; idx < num; idx++) {
+		siz = snprintf(suffix, sizeof(suffix), ".%s.local", types[idx]);
+		if (len > siz && strcasecmp(name + len - siz, suffix) == 0) {
+			name[len - siz] = '\0';
+			return types[idx];
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+ * Address records (A or AAAA) in text form, NULL for anything else
+ */
+
+static const char *
+query_address(const DNS_RR *rrp)
+{
+	if (rrp->rr_type == DNS_RR_TYPE_A) {
+		return rrp->rr.rr_a.a_addr_str;
+	}
+	if (rrp->rr_type == DNS_RR_TYPE_AAAA) {
+		return rrp->rr.rr_aaaa.aaaa_addr_str;
+	}
+
+	return NULL;
+}
+
+
+/*
+ * One instance of an answer: its SRV record, the TXT with the same
+ * owner and the addresses of the SRV target (best first). Returns 1
+ * if the SRV belonged to one of the requested types.
+ */
+
+static int
+query_add_instance(DNS_RR *rrs, int res, DNS_RR *srv, const char *iface)
+{
+	char name[DNS_NAME_SIZE], *target;
+	const char *type, *addr;
 	DNS_RR_TXT *txt;
-	char *ipv4, *ipv6, *name, *ptr;
+	DNS_RR *rrp;
 	result_t *result;
+	txt_t *head, *tmp;
+	int num, port;
 
-	len = sizeof(addr);
-	cnt = recvfrom(my_sock, buf, sizeof(buf), 0, (struct sockaddr *) &addr, &len);
-	buf[cnt] = '\0';
+	UTIL_STRCPY(name, srv->rr_name);
+	if ((type = query_instance_type(name)) == NULL) {
+		util_debug(3, "query: skip %s (other type)", name);
+		return 0;
+	}
+	port   = srv->rr.rr_srv.srv_port;
+	target = srv->rr.rr_srv.srv_target;
 
-	if ((res = parser_parse_answer(buf, cnt, rrs, sizeof(rrs))) == -1) {
-		util_error(__func__, __LINE__, "%s", parser_get_error());
-		return;
+	addr = NULL;
+	txt  = NULL;
+	for (num = 0, rrp = rrs; num < res; num++, rrp++) {
+		if (addr == NULL && query_address(rrp) != NULL && strcasecmp(rrp->rr_name, target) == 0) {
+			addr = query_address(rrp);
+		}
+		if (txt == NULL && rrp->rr_type == DNS_RR_TYPE_TXT && strcasecmp(rrp->rr_name, srv->rr_name) == 0) {
+			txt = &(rrp->rr.rr_txt);		// will check for iTunes
+		}
 	}
-	if (res == 0) {
-		util_debug(3, "query: got DNS message, but no answer");
-		return;
+
+	if (request_match_name(name) == 0) {
+		util_debug(3, "query: skip %s", name);
+		return 1;
+	}
+	if (addr == NULL) {
+		util_debug(1, "query: incomplete answer (missing address)");
+		stats_inc(STATS_INCOMPLETE);
+		return 1;
+	}
+	if (port == 0) {
+		util_debug(1, "query: incomplete answer (missing port)");
+		stats_inc(STATS_INCOMPLETE);
+		return 1;
 	}
 
-	UTIL_STRCPY(answer, "    {\n");
-	port = 0;
-	ipv4 = ipv6 = name = NULL;
-	txt = NULL;
+	//
+	// The TXT and port predicates are checked before anything is formatted
+	//
+	head = query_txt_list(txt);
+	if (request_match(name, head, port) == 0) {
+		util_debug(1, "query: filtered %s", name);
+		while (head != NULL) {
+			tmp = head->next;
+			util_free(head);
+			head = tmp;
+		}
+		return 1;
+	}
 
+	result = result_new(name, type, target, port, addr, iface, head);
 	for (num = 0, rrp = rrs; num < res; num++, rrp++) {
-		if (rrp->rr_type == DNS_RR_TYPE_A) {
-			util_append(answer, sizeof(answer), "      \"a\": \"%s\",\n", rrp->rr.rr_a.a_addr_str);
-			if (ipv4 == NULL) {
-				ipv4 = rrp->rr.rr_a.a_addr_str;
-			}
-			continue;
+		if (query_address(rrp) != NULL && strcasecmp(rrp->rr_name, target) == 0) {
+			result_add_address(result, query_address(rrp), iface);
 		}
+	}
+	query_add_result(result);
 
-		if (rrp->rr_type == DNS_RR_TYPE_PTR) {
-			name = rrp->rr.rr_ptr.ptr_dname;
-			if ((ptr = strstr(name, "._http._tcp.local")) != NULL) {
-				*ptr = '\0';
-			}
-			util_append(answer, sizeof(answer), "      \"name\": \"%s\",\n", name);
-			continue;
+	return 1;
+}
+
+
+/*
+ * An answer carries PTR, SRV and TXT of one or more instances (a host
+ * offering several of the requested types may put them all in one
+ * packet) plus the addresses of their targets. Each SRV makes an entry.
+ */
+
+static void
+query_add_service(DNS_RR *rrs, int res, const char *iface)
+{
+	int num, found, ptrs;
+	DNS_RR *rrp;
+
+	for (num = 0, found = ptrs = 0, rrp = rrs; num < res; num++, rrp++) {
+		if (rrp->rr_type == DNS_RR_TYPE_SRV) {
+			found += query_add_instance(rrs, res, rrp, iface);
 		}
+		ptrs += (rrp->rr_type == DNS_RR_TYPE_PTR);
+	}
 
-		if (rrp->rr_type == DNS_RR_TYPE_TXT) {
-			txt = &(rrp->rr.rr_txt);		// will check for iTunes
+	if (found == 0) {
+		util_debug(1, "query: incomplete answer (missing %s)", ptrs > 0 ? "port" : "name");
+		stats_inc(STATS_INCOMPLETE);
+	}
+}
+
+
+/*
+ * ResolveHost: collect the A and AAAA records for the requested .local host
+ */
+
+static void
+query_add_host(DNS_RR *rrs, int res, const char *iface)
+{
+	char *host;
+	int num, port;
+	DNS_RR *rrp;
+	result_t *result;
+
+	host = request_get_host();
+	result = NULL;
+
+	if ((port = request_get_host_port()) == 0) {
+		port = 80;
+	}
+
+	for (num = 0, rrp = rrs; num < res; num++, rrp++) {
+		if (query_address(rrp) == NULL || strcasecmp(rrp->rr_name, host) != 0) {
 			continue;
 		}
+		if (result == NULL) {
+			result = result_new(host, NULL, host, port, query_address(rrp), iface, NULL);
+		} else {
+			result_add_address(result, query_address(rrp), iface);
+		}
+	}
+	if (result == NULL) {
+		util_debug(1, "query: no address for %s in answer", host);
+		return;
+	}
 
-		//
-		// Ignore IPv6 address for now
-		//
-		//if (rrp->rr_type == DNS_RR_TYPE_AAAA) {
-		//	util_append(answer, sizeof(answer), "      \"aaaa\": \"%s\",\n", rrp->rr.rr_aaaa.aaaa_addr_str);
-		//	if (ipv6 == NULL) {
-		//		ipv6 = rrp->rr.rr_a.a_addr_str;
-		//	}
-		//	continue;
-		//}
+	query_add_result(result);
+}
 
-		if (rrp->rr_type == DNS_RR_TYPE_SRV) {
-			port = rrp->rr.rr_srv.srv_port;
-			util_append(answer, sizeof(answer), "      \"target\": \"%s\",\n", rrp->rr.rr_srv.srv_target);
-			util_append(answer, sizeof(answer), "      \"port\": %u,\n",       port);
+
+
+/*
+ * Types: the PTR records of the enumeration name point to the service
+ * types on the network, "_http._tcp.local" and so on (RFC 6763, 9.)
+ */
+
+static void
+query_add_types(DNS_RR *rrs, int res)
+{
+	char type[DNS_NAME_SIZE];
+	size_t len;
+	int num;
+	DNS_RR *rrp;
+
+	for (num = 0, rrp = rrs; num < res; num++, rrp++) {
+		if (rrp->rr_type != DNS_RR_TYPE_PTR || strcasecmp(rrp->rr_name, QUERY_SERVICES) != 0) {
 			continue;
 		}
+		UTIL_STRCPY(type, rrp->rr.rr_ptr.ptr_dname);
+		if ((len = strlen(type)) > 6 && strcasecmp(type + len - 6, ".local") == 0) {
+			type[len - 6] = '\0';
+		}
+		if (result_add_type(type) == 1) {
+			util_info("query found service type %s", type);
+		}
 	}
+}
 
-	if (name == NULL) {
-		util_debug(1, "query: incomplete answer (missing name)");
-		return;
+static void
+query_iface_name(unsigned int index, char *name)
+{
+	int idx;
+
+	for (idx = 0; idx < my_iface_cnt; idx++) {
+		if (my_ifaces[idx].index == index) {
+			strcpy(name, my_ifaces[idx].name);
+			return;
+		}
+	}
+
+	if (if_indextoname(index, name) == NULL) {
+		*name = '\0';
+	}
+}
+
+
+/*
+ * Everything after the receive: drops, interface, counters and parsing
+ */
+
+static void
+query_packet(int sock, char *buf, int cnt, struct msghdr *msg)
+{
+	static DNS_RR rrs[QUERY_RRS];
+	char from[INET6_ADDRSTRLEN], iface[IF_NAMESIZE];
+	struct sockaddr_storage addr;
+	struct in_pktinfo info;
+	struct in6_pktinfo info6;
+	struct cmsghdr *cmsg;
+	int res;
+	uint64_t start;
+
+	buf[cnt] = '\0';
+	my_packets++;
+
+	// the kernel reports the total number of drops on this socket so far
+	*iface = '\0';
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+			memcpy(&my_drops[sock == my_sock6], CMSG_DATA(cmsg), sizeof(uint32_t));
+			stats_set(STATS_RXQ_OVERFLOWS, (unsigned long) my_drops[0] + my_drops[1]);
+		}
+		if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
+			memcpy(&info, CMSG_DATA(cmsg), sizeof(info));
+			query_iface_name(info.ipi_ifindex, iface);
+		}
+		if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_PKTINFO) {
+			memcpy(&info6, CMSG_DATA(cmsg), sizeof(info6));
+			query_iface_name(info6.ipi6_ifindex, iface);
+		}
 	}
-	if (ipv4 == NULL) {
-		util_debug(1, "query: incomplete answer (missing IPv4)");
+
+	if (cnt >= (int) sizeof(DNS_HEADER)) {
+		stats_inc((buf[2] & 0x80) ? STATS_RESPONSES : STATS_QUERIES);
+	}
+
+	start = trace_now();
+	res = parser_parse_answer(buf, cnt, rrs, sizeof(rrs) / sizeof(rrs[0]));
+	if (trace_enabled()) {
+		memset(&addr, '\0', sizeof(addr));
+		memcpy(&addr, msg->msg_name, msg->msg_namelen < sizeof(addr) ? msg->msg_namelen : sizeof(addr));
+		if (addr.ss_family == AF_INET6) {
+			inet_ntop(AF_INET6, &((struct sockaddr_in6 *) &addr)->sin6_addr, from, sizeof(from));
+		} else {
+			inet_ntop(AF_INET, &((struct sockaddr_in *) &addr)->sin_addr, from, sizeof(from));
+		}
+		trace_complete(trace_responder(from), "query", "packet", start, from, res);
+	}
+
+	if (res == -1) {
+		stats_parse_error(parser_get_reason());
+		util_error(__func__, __LINE__, "%s", parser_get_error());
 		return;
 	}
-	if (port == 0) {
-		util_debug(1, "query: incomplete answer (missing port)");
+	stats_add(STATS_UNKNOWN_RR, parser_get_unknown());
+	if (res == 0) {
+		util_debug(3, "query: got DNS message, but no answer");
 		return;
 	}
+	timing_answer();
 
-	if (txt == NULL || txt->txt_cnt == 0) {
-		util_append(answer, sizeof(answer), "      \"txt\": [],\n");
+	if (strcmp(request_get_cmd(), "ResolveHost") == 0) {
+		query_add_host(rrs, res, iface);
+	} else if (strcmp(request_get_cmd(), "Types") == 0) {
+		query_add_types(rrs, res);
 	} else {
-		util_append(answer, sizeof(answer), "      \"txt\": [\n");
-		if (port == 3689) {
-			util_append(answer, sizeof(answer), "        \"DAAP (iTunes) Server\",\n");
-		}
-		for (cnt = 0; cnt < txt->txt_cnt - 1; cnt++) {
-			util_append(answer, sizeof(answer), "        \"%s\",\n", txt->txt_data[cnt]);
+		query_add_service(rrs, res, iface);
+	}
+}
+
+
+/*
+ * One datagram per wakeup, the fallback if nothing better works
+ */
+
+static void
+query_read_answer(int sock)
+{
+	static char buf[MDNS_SIZE];
+	char ctl[QUERY_CONTROL];
+	struct sockaddr_storage addr;
+	struct msghdr msg;
+	struct iovec iov;
+	int cnt;
+
+	iov.iov_base = buf;
+	iov.iov_len  = sizeof(buf) - 1;
+	memset(&msg, '\0', sizeof(msg));
+	msg.msg_name       = &addr;
+	msg.msg_namelen    = sizeof(addr);
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = ctl;
+	msg.msg_controllen = sizeof(ctl);
+
+	if ((cnt = recvmsg(sock, &msg, 0)) < 0) {
+		util_error(__func__, __LINE__, "recvmsg: %s", strerror(errno));
+		return;
+	}
+
+	query_packet(sock, buf, cnt, &msg);
+}
+
+
+/*
+ * Up to QUERY_BATCH datagrams per syscall, a burst of answers after
+ * the question needs a few wakeups instead of one per packet
+ */
+
+static void
+query_read_batch(int sock)
+{
+	static char bufs[QUERY_BATCH][MDNS_SIZE];
+	static char ctls[QUERY_BATCH][QUERY_CONTROL];
+	static struct sockaddr_storage addrs[QUERY_BATCH];
+	struct mmsghdr msgs[QUERY_BATCH];
+	struct iovec iovs[QUERY_BATCH];
+	int idx, cnt;
+
+	memset(msgs, '\0', sizeof(msgs));
+	for (idx = 0; idx < QUERY_BATCH; idx++) {
+		iovs[idx].iov_base = bufs[idx];
+		iovs[idx].iov_len  = MDNS_SIZE - 1;
+		msgs[idx].msg_hdr.msg_name       = &addrs[idx];
+		msgs[idx].msg_hdr.msg_namelen    = sizeof(addrs[idx]);
+		msgs[idx].msg_hdr.msg_iov        = &iovs[idx];
+		msgs[idx].msg_hdr.msg_iovlen     = 1;
+		msgs[idx].msg_hdr.msg_control    = ctls[idx];
+		msgs[idx].msg_hdr.msg_controllen = QUERY_CONTROL;
+	}
+
+	if ((cnt = recvmmsg(sock, msgs, QUERY_BATCH, MSG_DONTWAIT, NULL)) < 0) {
+		if (errno == ENOSYS) {
+			util_info("no recvmmsg, reading one datagram at a time");
+			my_receive = "recvmsg";
+			query_read_answer(sock);
+		} else if (errno != EAGAIN) {
+			util_error(__func__, __LINE__, "recvmmsg: %s", strerror(errno));
 		}
-		util_append(answer, sizeof(answer), "        \"%s\"\n", txt->txt_data[cnt]);
-		util_append(answer, sizeof(answer), "      ],\n");
+		return;
+	}
+
+	for (idx = 0; idx < cnt; idx++) {
+		query_packet(sock, bufs[idx], msgs[idx].msg_len, &msgs[idx].msg_hdr);
+	}
+}
+
+
+/*
+ * SO_RCVBUFFORCE may exceed net.core.rmem_max but needs CAP_NET_ADMIN,
+ * so plain SO_RCVBUF (capped by rmem_max) is the fallback.
+ */
+
+static void
+query_set_rcvbuf(int sock, int size)
+{
+	int actual = 0;
+	socklen_t len = sizeof(actual);
+
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0 &&
+	    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0) {
+		util_error(__func__, __LINE__, "setsockopt(SO_RCVBUF): %s", strerror(errno));
+		return;
 	}
 
-	snprintf(url, sizeof(url), "http://%s:%d/", ipv4, port);
-	util_append(answer, sizeof(answer), "      \"url\": \"%s\"\n", url);
-	UTIL_STRCAT(answer, "    }");
+	// the kernel doubles the value for its bookkeeping overhead
+	getsockopt(sock, SOL_SOCKET, SO_RCVBUF, &actual, &len);
+	util_info("mDNS socket receive buffer %d bytes (asked for %d)", actual / 2, size);
+}
+
+
+/*
+ * Lookup browses for PTR records, Resolve asks directly for SRV and TXT
+ * of one instance and ResolveHost for the A and AAAA records of one host.
+ * Types asks for the service type enumeration instead.
+ * All service types go into one packet, N types still cost one round.
+ */
 
-	for (result = my_results; result != NULL; result = result->next) {
-		if (strcmp(result->text, answer) == 0) {
-			return;		// duplicate entry
+static size_t
+query_create_question(char *data, size_t len)
+{
+	const char *types[REQUEST_TYPES];
+	char name[DNS_NAME_SIZE], names[1024], *cmd;
+	size_t ofs;
+	int num, idx;
+
+	cmd = request_get_cmd();
+	*names = '\0';
+
+	if (strcmp(cmd, "ResolveHost") == 0) {
+		UTIL_STRCPY(names, request_get_host());
+		ofs = parser_create_query(data, len, names, DNS_RR_TYPE_A);
+		ofs = parser_add_question(data, len, ofs, names, DNS_RR_TYPE_AAAA);
+	} else if (strcmp(cmd, "Types") == 0) {
+		UTIL_STRCPY(names, QUERY_SERVICES);
+		ofs = parser_create_query(data, len, names, DNS_RR_TYPE_PTR);
+	} else {
+		num = request_get_types(types, REQUEST_TYPES);
+		for (idx = 0, ofs = sizeof(DNS_HEADER); idx < num; idx++) {
+			if (strcmp(cmd, "Resolve") == 0) {
+				snprintf(name, sizeof(name), "%s.%s.local", request_get_name(), types[idx]);
+				ofs = (idx == 0) ? parser_create_query(data, len, name, DNS_RR_TYPE_SRV) :
+						parser_add_question(data, len, ofs, name, DNS_RR_TYPE_SRV);
+				ofs = parser_add_question(data, len, ofs, name, DNS_RR_TYPE_TXT);
+			} else {
+				snprintf(name, sizeof(name), "%s.local", types[idx]);
+				ofs = (idx == 0) ? parser_create_query(data, len, name, DNS_RR_TYPE_PTR) :
+						parser_add_question(data, len, ofs, name, DNS_RR_TYPE_PTR);
+			}
+			util_append(names, sizeof(names), "%s%s", idx > 0 ? ", " : "", name);
 		}
 	}
 
-	result = util_malloc(sizeof(result_t));
-	result->next = my_results;
-	result->text = util_strdup(answer);
-	my_results = result;
+	util_info("sending mDNS-SD question for %s (%s)", names, cmd);
+	trace_instant(TRACE_LANE_QUERY, "query", "question", names);
+
+	return ofs;
 }
 
 
-result_t *
-query_browse(void)
+/*
+ * Common socket options for both families
+ */
+
+static void
+query_socket_options(int sock)
 {
-	struct sockaddr_in addr;
-	socklen_t addrlen;
-	struct ip_mreq mreq;
-	int one = 1, timeout, ret;
-	struct pollfd fds[1];
-	char data[MDNS_SIZE];
-	ssize_t len, cnt;
+	int one = 1;
+
+	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0) {
+		util_fatal("setsockopt(SO_REUSEADDR): %s", strerror(errno));
+	}
+	if (setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one)) < 0) {
+		util_info("setsockopt(SO_RXQ_OVFL): %s", strerror(errno));
+	}
+	query_set_rcvbuf(sock, config_get_rcvbuf());
+}
+
+
+static int
+query_join(unsigned int index)
+{
+	struct ip_mreqn mreq;
+
+	memset(&mreq, '\0', sizeof(mreq));
+	mreq.imr_multiaddr.s_addr = inet_addr(INADDR_MDNS);
+	mreq.imr_ifindex          = index;
+
+	return setsockopt(my_sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
+}
 
-	atexit(query_cleanup);
-	timeout = config_get_timeout() * 1000;
-	util_info("using mDNS-SD query for discovery (%d ms)", timeout);
+
+static void
+query_open_inet(void)
+{
+	struct sockaddr_in addr;
+	int one = 1, ttl = MDNS_TTL, idx;
 
 	if ((my_sock = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
 		util_fatal("socket: %s", strerror(errno));
 	}
-	if (setsockopt(my_sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0) {
-		util_fatal("setsockopt(SO_REUSEADDR): %s", strerror(errno));
+	query_socket_options(my_sock);
+	if (setsockopt(my_sock, IPPROTO_IP, IP_PKTINFO, &one, sizeof(one)) < 0) {
+		util_info("setsockopt(IP_PKTINFO): %s", strerror(errno));
 	}
+	setsockopt(my_sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
 
 	addr.sin_family      = AF_INET;
 	addr.sin_port        = htons(MDNS_PORT);
 	addr.sin_addr.s_addr = inet_addr(INADDR_MDNS);
-	addrlen = sizeof(addr);
-	if (bind(my_sock, (struct sockaddr *) &addr, addrlen) < 0) {
+	if (bind(my_sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
 		util_fatal("bind: %s", strerror(errno));
 	}
 
-	mreq.imr_multiaddr.s_addr = inet_addr(INADDR_MDNS);
-	mreq.imr_interface.s_addr = htonl(INADDR_ANY);
-	if (setsockopt(my_sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+	//
+	// Join on every allowed interface; if they can't be listed, the kernel picks one
+	//
+	for (idx = 0; idx < my_iface_cnt; idx++) {
+		if (my_ifaces[idx].addr.s_addr != 0 && query_join(my_ifaces[idx].index) < 0) {
+			util_error(__func__, __LINE__, "IP_ADD_MEMBERSHIP %s: %s", my_ifaces[idx].name, strerror(errno));
+			my_ifaces[idx].addr.s_addr = 0;
+		}
+	}
+	if (my_iface_cnt == 0 && query_join(0) < 0) {
 		util_fatal("setsockopt(IP_ADD_MEMBERSHIP): %s", strerror(errno));
-	} 
+	}
+}
 
-	len = (ssize_t) parser_create_query(data, sizeof(data), QUERY_NAME, DNS_RR_TYPE_PTR);
-	if (len == 0) {
-		util_fatal("%s", parser_get_error());
+
+/*
+ * IPv6 is optional, without it the IPv4 socket carries on alone
+ */
+
+static void
+query_open_inet6(void)
+{
+	struct sockaddr_in6 addr;
+	struct ipv6_mreq mreq;
+	int one = 1, hops = MDNS_TTL, idx, joined;
+
+	if ((my_sock6 = socket(AF_INET6, SOCK_DGRAM, 0)) == -1) {
+		util_info("no IPv6 mDNS socket: %s", strerror(errno));
+		my_sock6 = 0;
+		return;
+	}
+	query_socket_options(my_sock6);
+	setsockopt(my_sock6, IPPROTO_IPV6, IPV6_V6ONLY, &one, sizeof(one));
+	setsockopt(my_sock6, IPPROTO_IPV6, IPV6_RECVPKTINFO, &one, sizeof(one));
+	setsockopt(my_sock6, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &hops, sizeof(hops));
+
+	memset(&addr, '\0', sizeof(addr));
+	addr.sin6_family = AF_INET6;
+	addr.sin6_port   = htons(MDNS_PORT);
+	addr.sin6_addr   = in6addr_any;
+	if (bind(my_sock6, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		util_info("can't bind IPv6 mDNS socket: %s", strerror(errno));
+		close(my_sock6);
+		my_sock6 = 0;
+		return;
+	}
+
+	for (idx = joined = 0; idx < (my_iface_cnt > 0 ? my_iface_cnt : 1); idx++) {
+		if (my_iface_cnt > 0 && my_ifaces[idx].inet6 == 0) {
+			continue;
+		}
+		inet_pton(AF_INET6, IN6ADDR_MDNS, &mreq.ipv6mr_multiaddr);
+		mreq.ipv6mr_interface = (my_iface_cnt > 0) ? my_ifaces[idx].index : 0;
+		if (setsockopt(my_sock6, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mreq, sizeof(mreq)) < 0) {
+			util_info("IPV6_JOIN_GROUP %s: %s",
+					my_iface_cnt > 0 ? my_ifaces[idx].name : "default", strerror(errno));
+			continue;
+		}
+		joined++;
+	}
+
+	if (joined == 0) {
+		close(my_sock6);
+		my_sock6 = 0;
+	}
+}
+
+
+static int
+query_send(char *data, size_t len, iface_t *iface)
+{
+	struct sockaddr_in addr;
+	struct ip_mreqn mreq;
+
+	if (iface != NULL) {
+		if (iface->addr.s_addr == 0) {
+			return -1;	// IPv6 only
+		}
+		memset(&mreq, '\0', sizeof(mreq));
+		mreq.imr_ifindex = iface->index;
+		if (setsockopt(my_sock, IPPROTO_IP, IP_MULTICAST_IF, &mreq, sizeof(mreq)) < 0) {
+			util_error(__func__, __LINE__, "IP_MULTICAST_IF %s: %s", iface->name, strerror(errno));
+			return -1;
+		}
 	}
-	util_info("sending mDNS-SD question");
 
 	addr.sin_family      = AF_INET;
 	addr.sin_port        = htons(MDNS_PORT);
 	addr.sin_addr.s_addr = inet_addr(INADDR_MDNS);
-	addrlen = sizeof(addr);
-	cnt = sendto(my_sock, data, len, 0, (struct sockaddr *) &addr, addrlen);
-	if (cnt != len) {
-		util_fatal("can't send query (%s)", strerror(errno));
-	}
-
-	for (;;) {
-		fds[0].fd = my_sock;
-		fds[0].events = POLLIN;
-		if ((ret = poll(fds, 1, timeout)) == -1) {
-			util_error(__func__, __LINE__, "can't poll mDNS-Sock (%s)", strerror(errno));
-			break;
-		}
-		if (ret == 0) {
-			util_info("timeout on mDNS-Sock");
-			break;
-		}
+	if (sendto(my_sock, data, len, 0, (struct sockaddr *) &addr, sizeof(addr)) != (ssize_t) len) {
+		util_error(__func__, __LINE__, "can't send query on %s (%s)",
+				iface != NULL ? iface->name : "default", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
 
-		if (fds[0].revents & POLLIN) {
-			query_read_answer();
+
+static int
+query_send6(char *data, size_t len, iface_t *iface)
+{
+	struct sockaddr_in6 addr;
+	int index;
+
+	if (my_sock6 == 0 || (iface != NULL && iface->inet6 == 0)) {
+		return -1;
+	}
+
+	index = (iface != NULL) ? (int) iface->index : 0;
+	if (setsockopt(my_sock6, IPPROTO_IPV6, IPV6_MULTICAST_IF, &index, sizeof(index)) < 0) {
+		util_error(__func__, __LINE__, "IPV6_MULTICAST_IF %s: %s",
+				iface != NULL ? iface->name : "default", strerror(errno));
+		return -1;
+	}
+
+	memset(&addr, '\0', sizeof(addr));
+	addr.sin6_family   = AF_INET6;
+	addr.sin6_port     = htons(MDNS_PORT);
+	addr.sin6_scope_id = index;
+	inet_pton(AF_INET6, IN6ADDR_MDNS, &addr.sin6_addr);
+	if (sendto(my_sock6, data, len, 0, (struct sockaddr *) &addr, sizeof(addr)) != (ssize_t) len) {
+		util_error(__func__, __LINE__, "can't send IPv6 query on %s (%s)",
+				iface != NULL ? iface->name : "default", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+
+static void
+query_readable(int fd, unsigned int events, void *data)
+{
+	(void) events;
+	(void) data;
+
+	if (strcmp(my_receive, "recvmsg") == 0) {
+		query_read_answer(fd);
+	} else {
+		query_read_batch(fd);
+	}
+}
+
+
+/*
+ * Datagrams from the io_uring, or NULL if it gave up on the socket
+ */
+
+static void
+query_uring_packet(int sock, char *buf, int len, struct msghdr *msg)
+{
+	if (buf != NULL) {
+		query_packet(sock, buf, len, msg);
+		return;
+	}
+
+	util_error(__func__, __LINE__, "io_uring stopped on socket %d (%s), using recvmmsg", sock, strerror(-len));
+	my_receive = "recvmmsg";
+	if (sock == my_sock6) {
+		my_watch6 = loop_watch_add(sock, EPOLLIN, query_readable, NULL);
+	} else {
+		my_watch = loop_watch_add(sock, EPOLLIN, query_readable, NULL);
+	}
+}
+
+
+static double
+query_cpu_ms(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+
+	return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000.0 +
+		(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000.0;
+}
+
+
+/*
+ * Pick the receive path: io_uring where the kernel has multishot
+ * recvmsg, else recvmmsg batches, else one recvmsg per wakeup
+ */
+
+static void
+query_receive(void)
+{
+	const char *want = config_get_receive();
+	int sock6 = (my_sock6 > 0);
+
+	my_receive = (strcmp(want, "recvmsg") == 0) ? "recvmsg" : "recvmmsg";
+	if ((strcmp(want, "auto") == 0 || strcmp(want, "io_uring") == 0) && uring_open(MDNS_SIZE) == 0) {
+		if (uring_recvmsg(my_sock, sizeof(struct sockaddr_storage), QUERY_CONTROL, query_uring_packet) == 0 &&
+				(sock6 == 0 || uring_recvmsg(my_sock6, sizeof(struct sockaddr_storage),
+					QUERY_CONTROL, query_uring_packet) == 0)) {
+			my_receive = "io_uring";
+			util_info("mDNS receive path io_uring");
+			return;
 		}
+		uring_close();
 	}
 
-	return my_results;
+	my_watch = loop_watch_add(my_sock, EPOLLIN, query_readable, NULL);
+	if (sock6) {
+		my_watch6 = loop_watch_add(my_sock6, EPOLLIN, query_readable, NULL);
+	}
+	util_info("mDNS receive path %s", my_receive);
 }
 
+
+/*
+ * Open the sockets, hook them into the loop and send the question.
+ * Whatever runs the loop (query_browse() or Avahi next to it) reads
+ * the answers. Returns -1 if there is nothing to listen on.
+ */
+
+int
+query_start(void)
+{
+	int timeout, idx, sent;
+	char data[MDNS_SIZE];
+	size_t len;
+
+	if (my_sock > 0) {
+		return 0;	// already running next to Avahi
+	}
+
+	atexit(query_cleanup);
+	timeout = config_get_timeout() * 1000;
+	util_info("using mDNS-SD query for discovery (%d ms)", timeout);
+
+	//
+	// All interfaces share one window
+	//
+	my_deadline = loop_now() + (uint64_t) timeout * 1000;
+
+	if ((my_iface_cnt = iface_find(my_ifaces, QUERY_IFACES)) == 0) {
+		util_error(__func__, __LINE__, "no interface allowed by the interface policy");
+		return -1;
+	}
+	if (my_iface_cnt < 0) {
+		my_iface_cnt = 0;
+	}
+
+	query_open_inet();
+	query_open_inet6();
+	my_packets = 0;
+	my_cpu_ms  = query_cpu_ms();
+	query_receive();
+	timing_mark(TIMING_INIT);
+
+	if ((len = query_create_question(data, sizeof(data))) == 0) {
+		util_fatal("%s", parser_get_error());
+	}
+
+	//
+	// Both families on all interfaces at once
+	//
+	sent = 0;
+	for (idx = 0; idx < my_iface_cnt; idx++) {
+		sent += (query_send(data, len, &my_ifaces[idx]) == 0);
+		sent += (query_send6(data, len, &my_ifaces[idx]) == 0);
+	}
+	if (my_iface_cnt == 0) {
+		sent += (query_send(data, len, NULL) == 0);
+		sent += (query_send6(data, len, NULL) == 0);
+	}
+	if (sent == 0) {
+		util_fatal("can't send query on any interface");
+	}
+	timing_mark(TIMING_SENT);
+
+	return 0;
+}
+
+
+uint64_t
+query_deadline(void)
+{
+	return my_deadline;
+}
+
+
+void
+query_stop(void)
+{
+	uring_close();
+	loop_watch_free(my_watch);
+	loop_watch_free(my_watch6);
+	my_watch = my_watch6 = NULL;
+	util_info("mDNS receive via %s: %lu packets, %.3f ms CPU", my_receive, my_packets, query_cpu_ms() - my_cpu_ms);
+
+	if (stats_get(STATS_RXQ_OVERFLOWS) > 0) {
+		util_error(__func__, __LINE__, "socket dropped %lu packets, raise rcvbuf (now %d) in %s",
+				stats_get(STATS_RXQ_OVERFLOWS), config_get_rcvbuf(), "the config file or with --rcvbuf");
+	}
+	trace_instant(TRACE_LANE_MAIN, "main", "stop", "query");
+}
+
+
+static int
+query_done(void)
+{
+	if (request_satisfied(result_get_count() + result_get_type_count())) {
+		util_info("query got %d matching results, stop listening", result_get_count() + result_get_type_count());
+		return 1;
+	}
+
+	return 0;
+}
+
+
+result_t *
+query_browse(void)
+{
+	if (query_start() < 0) {
+		return result_get_list();
+	}
+
+	if (loop_run(my_deadline, query_done) == 0) {
+		util_info("timeout on mDNS-Sock");
+	}
+	timing_mark(TIMING_STOP);
+	query_stop();
+
+	return result_get_list();
+}
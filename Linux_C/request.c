@@ -0,0 +1,591 @@
+/****************************************************************************
+ *
+ * Copyright (c) 2017-2018 Volker Wiegand <volker@railduino.de>
+ *
+ * This file is part of Zeroconf-Lookup.
+ * Project home: https://www.railduino.de/zeroconf-lookup
+ * Source code:  https://github.com/railduino/zeroconf-lookup.git
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ ****************************************************************************/
+
+
+#include "common.h"
+
+#include <ctype.h>
+#include <fnmatch.h>
+#include <strings.h>
+
+
+#define REQUEST_SIZE	4096
+#define DEFAULT_TYPE	"_http._tcp"
+
+
+static char my_cmd[32]   = "Lookup";
+static char my_name[256] = "";
+static char my_txt[256]  = "";
+static char my_host[256] = "";
+static int  my_port      = 0;		// filter for browse requests
+static int  my_host_port = 0;		// URL port for ResolveHost
+static int  my_max       = 0;
+static int  my_compact   = 0;
+static int  my_timing    = 0;
+static char my_continue[1024] = "";
+static char my_interfaces[1024] = "";
+static char my_exclude[1024]    = "";
+static char my_types[1024]      = "";
+static int  my_probe     = PROBE_NONE;
+static int  my_drop      = 0;
+static int  my_fresh     = 0;
+static int  my_notxt     = 0;
+
+
+static char *
+request_skip_space(char *src)
+{
+	while (*src != '\0' && isspace((unsigned char) *src)) {
+		src++;
+	}
+
+	return src;
+}
+
+
+/*
+ * Copy a JSON string starting at the opening quote into dst.
+ * Returns the position after the closing quote, or NULL on error.
+ */
+
+static char *
+request_parse_string(char *src, char *dst, size_t len)
+{
+	size_t ofs = 0;
+	unsigned int code;
+	char chr;
+
+	if (*src++ != '"') {
+		return NULL;
+	}
+
+	while ((chr = *src++) != '"') {
+		if (chr == '\0') {
+			return NULL;
+		}
+		if (chr == '\\') {
+			switch ((chr = *src++)) {
+				case 'b': chr = '\b'; break;
+				case 'f': chr = '\f'; break;
+				case 'n': chr = '\n'; break;
+				case 'r': chr = '\r'; break;
+				case 't': chr = '\t'; break;
+				case 'u':
+					if (sscanf(src, "%4x", &code) != 1) {
+						return NULL;
+					}
+					chr = (code < 0x80) ? (char) code : '?';
+					src += 4;
+					break;
+				case '\0':
+					return NULL;
+				default:
+					break;	// covers \" \\ and \/
+			}
+		}
+		if (ofs < len - 1) {
+			dst[ofs++] = chr;
+		}
+	}
+	dst[ofs] = '\0';
+
+	return src;
+}
+
+
+/*
+ * Copy a bare JSON token (number, true, false, null) into dst.
+ */
+
+static char *
+request_parse_token(char *src, char *dst, size_t len)
+{
+	size_t ofs = 0;
+
+	while (*src != '\0' && strchr(",}] \t\r\n", *src) == NULL) {
+		if (ofs < len - 1) {
+			dst[ofs++] = *src;
+		}
+		src++;
+	}
+	dst[ofs] = '\0';
+
+	return ofs > 0 ? src : NULL;
+}
+
+
+/*
+ * Copy an array of strings like ["_http._tcp", "_ipp._tcp"] into dst
+ * as a comma separated list, the form the list keys take anyway. Other
+ * scalars are skipped. Returns the position after the closing bracket,
+ * or NULL on error.
+ */
+
+static char *
+request_parse_array(char *src, char *dst, size_t len)
+{
+	char item[256];
+
+	*dst = '\0';
+	src = request_skip_space(src + 1);
+	if (*src == ']') {
+		return src + 1;
+	}
+
+	for (;;) {
+		if (*src == '"') {
+			if ((src = request_parse_string(src, item, sizeof(item))) == NULL) {
+				return NULL;
+			}
+			util_append(dst, len, "%s%s", *dst != '\0' ? "," : "", item);
+		} else if (*src != '[' && *src != '{' && (src = request_parse_token(src, item, sizeof(item))) != NULL) {
+			util_error(__func__, __LINE__, "only strings in a list, skip %s", item);
+		} else {
+			return NULL;
+		}
+
+		src = request_skip_space(src);
+		if (*src == ']') {
+			return src + 1;
+		}
+		if (*src++ != ',') {
+			return NULL;
+		}
+		src = request_skip_space(src);
+	}
+}
+
+
+static void
+request_set(char *key, char *val)
+{
+	if (strcmp(key, "cmd") == 0) {
+		UTIL_STRCPY(my_cmd, val);
+	} else if (strcmp(key, "name") == 0) {
+		UTIL_STRCPY(my_name, val);
+	} else if (strcmp(key, "txt") == 0) {
+		UTIL_STRCPY(my_txt, val);
+	} else if (strcmp(key, "host") == 0) {
+		UTIL_STRCPY(my_host, util_strtrim(val, "."));
+		if (strchr(my_host, '.') == NULL) {
+			UTIL_STRCAT(my_host, ".local");
+		}
+	} else if (strcmp(key, "port") == 0) {
+		my_port = atoi(val);
+	} else if (strcmp(key, "max") == 0) {
+		my_max = atoi(val);
+	} else if (strcmp(key, "compact") == 0) {
+		my_compact = (strcmp(val, "true") == 0 || atoi(val) > 0);
+	} else if (strcmp(key, "timing") == 0) {
+		my_timing = (strcmp(val, "true") == 0 || atoi(val) > 0);
+	} else if (strcmp(key, "interfaces") == 0) {
+		UTIL_STRCPY(my_interfaces, val);
+	} else if (strcmp(key, "exclude") == 0) {
+		UTIL_STRCPY(my_exclude, val);
+	} else if (strcmp(key, "types") == 0) {
+		UTIL_STRCPY(my_types, val);
+	} else if (strcmp(key, "probe") == 0) {
+		if (strcmp(val, "head") == 0) {
+			my_probe = PROBE_HEAD;
+		} else if (strcmp(val, "race") == 0) {
+			my_probe = PROBE_RACE;
+		} else if (strcmp(val, "connect") == 0 || strcmp(val, "true") == 0 || atoi(val) > 0) {
+			my_probe = PROBE_CONNECT;
+		} else {
+			my_probe = PROBE_NONE;
+		}
+	} else if (strcmp(key, "drop") == 0) {
+		my_drop = (strcmp(val, "true") == 0 || atoi(val) > 0);
+	} else if (strcmp(key, "fresh") == 0) {
+		my_fresh = (strcmp(val, "true") == 0 || atoi(val) > 0);
+	} else if (strcmp(key, "notxt") == 0) {
+		my_notxt = (strcmp(val, "true") == 0 || atoi(val) > 0);
+	} else if (strcmp(key, "continue") == 0) {
+		UTIL_STRCPY(my_continue, val);
+	} else {
+		util_info("ignore request key '%s'", key);
+		return;
+	}
+
+	util_info("[request] %-7s '%s'", key, val);
+}
+
+
+static void
+request_parse_object(char *input)
+{
+	char buffer[REQUEST_SIZE], key[64], val[1024], *ptr;
+
+	//
+	// Firefox sends the request as a JSON string which contains the object
+	//
+	ptr = request_skip_space(input);
+	if (*ptr == '"') {
+		if (request_parse_string(ptr, buffer, sizeof(buffer)) == NULL) {
+			util_error(__func__, __LINE__, "invalid request string '%s'", input);
+			return;
+		}
+	} else {
+		UTIL_STRCPY(buffer, ptr);
+	}
+
+	ptr = request_skip_space(buffer);
+	if (*ptr++ != '{') {
+		util_error(__func__, __LINE__, "request is not an object '%s'", buffer);
+		return;
+	}
+
+	for (;;) {
+		ptr = request_skip_space(ptr);
+		if (*ptr == '}') {
+			return;
+		}
+		if ((ptr = request_parse_string(ptr, key, sizeof(key))) == NULL) {
+			break;
+		}
+		ptr = request_skip_space(ptr);
+		if (*ptr++ != ':') {
+			break;
+		}
+		ptr = request_skip_space(ptr);
+		if (*ptr == '"') {
+			ptr = request_parse_string(ptr, val, sizeof(val));
+		} else if (*ptr == '[') {
+			ptr = request_parse_array(ptr, val, sizeof(val));
+		} else {
+			ptr = request_parse_token(ptr, val, sizeof(val));
+		}
+		if (ptr == NULL) {
+			break;
+		}
+		request_set(key, val);
+
+		ptr = request_skip_space(ptr);
+		if (*ptr == ',') {
+			ptr++;
+		} else if (*ptr != '}') {
+			break;
+		}
+	}
+
+	util_error(__func__, __LINE__, "malformed request '%s'", buffer);
+}
+
+
+void
+request_parse(char *input)
+{
+	if (input == NULL || *input == '\0') {
+		return;
+	}
+
+	request_parse_object(input);
+
+	if (strcmp(my_cmd, "Resolve") == 0 && *my_name == '\0') {
+		util_error(__func__, __LINE__, "Resolve needs a name, fall back to Lookup");
+		UTIL_STRCPY(my_cmd, "Lookup");
+	}
+	if (strcmp(my_cmd, "ResolveHost") == 0 && *my_host == '\0') {
+		util_error(__func__, __LINE__, "ResolveHost needs a host, fall back to Lookup");
+		UTIL_STRCPY(my_cmd, "Lookup");
+		my_port = 0;	// meant for the URL, must not filter the browse
+	}
+
+	//
+	// ResolveHost has no SRV to match, there "port" goes into the URL
+	//
+	if (strcmp(my_cmd, "ResolveHost") == 0) {
+		my_host_port = my_port;
+		my_port = 0;
+	}
+}
+
+
+char *
+request_get_cmd(void)
+{
+	return my_cmd;
+}
+
+
+char *
+request_get_name(void)
+{
+	return my_name;
+}
+
+
+char *
+request_get_host(void)
+{
+	return my_host;
+}
+
+
+int
+request_get_host_port(void)
+{
+	return my_host_port;
+}
+
+
+int
+request_get_max(void)
+{
+	return my_max;
+}
+
+
+int
+request_get_compact(void)
+{
+	return my_compact;
+}
+
+
+int
+request_get_timing(void)
+{
+	return my_timing;
+}
+
+
+char *
+request_get_continue(void)
+{
+	return my_continue;
+}
+
+
+char *
+request_get_interfaces(void)
+{
+	return my_interfaces;
+}
+
+
+char *
+request_get_exclude(void)
+{
+	return my_exclude;
+}
+
+
+int
+request_get_probe(void)
+{
+	return my_probe;
+}
+
+
+int
+request_get_drop(void)
+{
+	return my_drop;
+}
+
+
+int
+request_get_fresh(void)
+{
+	return my_fresh;
+}
+
+
+/*
+ * The service types of this lookup: the request's list, else the one
+ * from the config, like "_http._tcp,_https._tcp,_ipp._tcp". A trailing
+ * ".local" is dropped, anything not "_name._tcp" or "_name._udp" is
+ * skipped. Falls back to DEFAULT_TYPE, so there is always one.
+ */
+
+int
+request_get_types(const char **list, int max)
+{
+	static char types[REQUEST_TYPES][64];
+	static int count = -1;		// parsed on first use
+	char buffer[1024], *tok, *save;
+	size_t len;
+	int idx, dup;
+
+	if (count < 0) {
+		UTIL_STRCPY(buffer, *my_types != '\0' ? my_types : config_get_types());
+		count = 0;
+
+		for (tok = strtok_r(buffer, ", ", &save); tok != NULL; tok = strtok_r(NULL, ", ", &save)) {
+			len = strlen(tok);
+			if (len > 6 && strcasecmp(tok + len - 6, ".local") == 0) {
+				tok[len -= 6] = '\0';
+			}
+			if (*tok != '_' || len < 7 || len >= sizeof(types[0]) ||
+					(strcasecmp(tok + len - 5, "._tcp") != 0 && strcasecmp(tok + len - 5, "._udp") != 0)) {
+				util_error(__func__, __LINE__, "invalid service type '%s'", tok);
+				continue;
+			}
+			for (idx = 0, dup = 0; idx < count; idx++) {
+				dup |= (strcasecmp(types[idx], tok) == 0);
+			}
+			if (dup == 0 && count < REQUEST_TYPES) {
+				UTIL_STRCPY(types[count], tok);
+				count++;
+			}
+		}
+		if (count == 0) {
+			UTIL_STRCPY(types[count], DEFAULT_TYPE);
+			count++;
+		}
+	}
+
+	for (idx = 0; idx < count && idx < max; idx++) {
+		list[idx] = types[idx];
+	}
+
+	return idx;
+}
+
+
+/*
+ * TXT records are needed unless the caller said so and no TXT filter is set
+ */
+
+int
+request_need_txt(void)
+{
+	return my_notxt == 0 || *my_txt != '\0';
+}
+
+
+/*
+ * Instance names are compared case-insensitive (like all DNS names),
+ * shell wildcards are allowed.
+ */
+
+static char *
+request_lower(char *dst, const char *src, size_t len)
+{
+	size_t ofs;
+
+	for (ofs = 0; ofs < len - 1 && src[ofs] != '\0'; ofs++) {
+		dst[ofs] = (char) tolower((unsigned char) src[ofs]);
+	}
+	dst[ofs] = '\0';
+
+	return dst;
+}
+
+
+int
+request_match_name(const char *name)
+{
+	char pattern[256], string[256];
+
+	if (*my_name == '\0') {
+		return 1;
+	}
+	if (name == NULL) {
+		return 0;
+	}
+
+	request_lower(pattern, my_name, sizeof(pattern));
+	request_lower(string,  name,    sizeof(string));
+
+	return fnmatch(pattern, string, 0) == 0;
+}
+
+
+/*
+ * The TXT predicate is either "key" (key must be present) or
+ * "key=value" (value may contain shell wildcards).
+ * TXT keys are case-insensitive, see RFC 6763 section 6.4.
+ */
+
+static int
+request_match_txt(const txt_t *txt)
+{
+	char *sep;
+	size_t len;
+
+	if (*my_txt == '\0') {
+		return 1;
+	}
+
+	sep = strchr(my_txt, '=');
+	len = (sep != NULL) ? (size_t) (sep - my_txt) : strlen(my_txt);
+
+	for ( ; txt != NULL; txt = txt->next) {
+		if (strncasecmp(txt->text, my_txt, len) != 0) {
+			continue;
+		}
+		if (sep == NULL) {
+			if (txt->text[len] == '\0' || txt->text[len] == '=') {
+				return 1;
+			}
+			continue;
+		}
+		if (txt->text[len] == '=' && fnmatch(sep + 1, txt->text + len + 1, 0) == 0) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+int
+request_match(const char *name, const txt_t *txt, int port)
+{
+	if (request_match_name(name) == 0) {
+		return 0;
+	}
+	if (my_port != 0 && my_port != port) {
+		return 0;
+	}
+
+	return request_match_txt(txt);
+}
+
+
+/*
+ * Resolve has at most one answer per service type, ResolveHost just one.
+ * For Types the count is the number of types and "max" applies.
+ */
+
+int
+request_satisfied(int count)
+{
+	const char *types[REQUEST_TYPES];
+
+	if (strcmp(my_cmd, "Resolve") == 0) {
+		return count >= request_get_types(types, REQUEST_TYPES);
+	}
+	if (strcmp(my_cmd, "ResolveHost") == 0) {
+		return count >= 1;
+	}
+
+	return my_max > 0 && count >= my_max;
+}
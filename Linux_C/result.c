@@ -0,0 +1,694 @@
+/****************************************************************************
+ *
+ * Copyright (c) 2017-2018 Volker Wiegand <volker@railduino.de>
+ *
+ * This file is part of Zeroconf-Lookup.
+ * Project home: https://www.railduino.de/zeroconf-lookup
+ * Source code:  https://github.com/railduino/zeroconf-lookup.git
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ ****************************************************************************/
+
+
+#include "common.h"
+
+#include <strings.h>
+
+
+static result_t *my_results = NULL;
+static int       my_count   = 0;
+
+#define RESULT_TYPES	64		// service types for the Types command
+
+static txt_t    *my_types      = NULL;	// sorted, see result_add_type()
+static int       my_type_count = 0;
+
+
+static void
+result_free(result_t *res)
+{
+	txt_t *txt;
+	addr_t *addr;
+
+	while (res->txt != NULL) {
+		txt = res->txt->next;
+		util_free(res->txt);
+		res->txt = txt;
+	}
+	while (res->addrs != NULL) {
+		addr = res->addrs->next;
+		util_free(res->addrs);
+		res->addrs = addr;
+	}
+
+	util_free(res->name);
+	util_free(res->type);
+	util_free(res->target);
+	util_free(res->a);
+	util_free(res->url);
+	util_free(res);
+}
+
+
+static void
+result_cleanup(void)
+{
+	result_t *tmp;
+	txt_t *txt;
+
+	while (my_results != NULL) {
+		tmp = my_results->next;
+		result_free(my_results);
+		my_results = tmp;
+	}
+	my_count = 0;
+
+	while (my_types != NULL) {
+		txt = my_types->next;
+		util_free(my_types);
+		my_types = txt;
+	}
+	my_type_count = 0;
+}
+
+
+/*
+ * The best address makes the URL. IPv6 literals go in brackets,
+ * link-local ones need the zone (RFC 6874), the interface that address
+ * was seen on, not the one of the first answer. Only _https._tcp gets
+ * https, printers (_ipp._tcp) and the rest serve their pages on http.
+ */
+
+static void
+result_set_url(result_t *res)
+{
+	const char *addr = res->addrs->text;
+	const char *scheme;
+	char url[1024];
+
+	scheme = (res->type != NULL && strcasecmp(res->type, "_https._tcp") == 0) ? "https" : "http";
+	if (strchr(addr, ':') == NULL) {
+		snprintf(url, sizeof(url), "%s://%s:%d/", scheme, addr, res->port);
+	} else if (res->addrs->rank == IFACE_RANK_LINK && res->addrs->iface[0] != '\0') {
+		snprintf(url, sizeof(url), "%s://[%s%%25%s]:%d/", scheme, addr, res->addrs->iface, res->port);
+	} else {
+		snprintf(url, sizeof(url), "%s://[%s]:%d/", scheme, addr, res->port);
+	}
+
+	util_free(res->a);
+	util_free(res->url);
+	res->a   = util_strdup(addr);
+	res->url = util_strdup(url);
+}
+
+
+/*
+ * Addresses are kept ordered by iface_rank(), IPv4 before IPv6 on the
+ * same rank and then by text so that the URL doesn't depend on the
+ * order the answers came in. Returns 1 if the address was new.
+ * An address keeps the interface of its first sighting.
+ */
+
+static int
+result_insert_address(result_t *res, const char *addr, const char *iface)
+{
+	addr_t *new, **pos;
+	int cmp;
+
+	for (pos = &res->addrs; *pos != NULL; pos = &(*pos)->next) {
+		if (strcmp((*pos)->text, addr) == 0) {
+			return 0;
+		}
+	}
+
+	new = util_malloc(sizeof(addr_t));
+	UTIL_STRCPY(new->text, addr);
+	if (iface != NULL) {
+		UTIL_STRCPY(new->iface, iface);
+	}
+	new->rank = iface_rank(addr);
+	new->rtt_ms = -1.0;
+
+	for (pos = &res->addrs; *pos != NULL; pos = &(*pos)->next) {
+		if ((cmp = new->rank - (*pos)->rank) == 0) {
+			cmp = (strchr(new->text, ':') != NULL) - (strchr((*pos)->text, ':') != NULL);
+		}
+		if (cmp < 0 || (cmp == 0 && strcmp(new->text, (*pos)->text) < 0)) {
+			break;
+		}
+	}
+	new->next = *pos;
+	*pos = new;
+
+	if (res->addrs == new) {
+		result_set_url(res);
+	}
+
+	return 1;
+}
+
+
+void
+result_add_address(result_t *res, const char *addr, const char *iface)
+{
+	result_insert_address(res, addr, iface);
+}
+
+
+/*
+ * A measured winner (see probe.c) beats the ranking, it becomes the URL
+ */
+
+void
+result_prefer_address(result_t *res, addr_t *addr)
+{
+	addr_t **pos;
+
+	for (pos = &res->addrs; *pos != NULL; pos = &(*pos)->next) {
+		if (*pos == addr) {
+			*pos = addr->next;
+			addr->next = res->addrs;
+			res->addrs = addr;
+			result_set_url(res);
+			return;
+		}
+	}
+}
+
+
+/*
+ * Create a new entry, the TXT list is taken over (and freed later).
+ * Port 3689 gets the extra DAAP line like in all other flavors.
+ * The type is the service type like "_http._tcp" (NULL for a host).
+ * The interface (NULL if unknown) is where the address was seen.
+ * More addresses may follow with result_add_address().
+ */
+
+result_t *
+result_new(const char *name, const char *type, const char *target, int port,
+		const char *addr, const char *iface, txt_t *txt)
+{
+	result_t *res;
+	txt_t *ptr;
+
+	if (port == 3689) {
+		ptr = util_malloc(sizeof(txt_t));
+		UTIL_STRCPY(ptr->text, "DAAP (iTunes) Server");
+		ptr->next = txt;
+		txt = ptr;
+	}
+
+	res = util_malloc(sizeof(result_t));
+	res->name   = util_strdup(name);
+	res->type   = (type != NULL) ? util_strdup(type) : NULL;
+	res->target = util_strdup(target);
+	res->port   = port;
+	res->txt    = txt;
+	res->reachable  = -1;
+	res->connect_ms = -1.0;
+	result_insert_address(res, addr, iface);
+
+	return res;
+}
+
+
+/*
+ * The identity of a service is instance name, type, target host and port.
+ * TXT is left out, the backends don't agree on the order of its strings.
+ */
+
+static int
+result_equal(const result_t *one, const result_t *two)
+{
+	if (strcmp(one->name, two->name) != 0 || one->port != two->port) {
+		return 0;
+	}
+	if (one->type != NULL && two->type != NULL) {
+		if (strcasecmp(one->type, two->type) != 0) {
+			return 0;
+		}
+	} else if (one->type != two->type) {
+		return 0;
+	}
+
+	return strcasecmp(one->target, two->target) == 0;
+}
+
+
+/*
+ * Returns 1 if the entry was added, 0 if it was a duplicate (and freed).
+ * Another answer for the same service (other family, other interface)
+ * only adds its addresses to the entry already there.
+ */
+
+int
+result_add(result_t *res)
+{
+	result_t *run;
+	addr_t *addr;
+	int added;
+
+	for (run = my_results; run != NULL; run = run->next) {
+		if (result_equal(run, res)) {
+			run->source |= res->source;
+			for (addr = res->addrs, added = 0; addr != NULL; addr = addr->next) {
+				added += result_insert_address(run, addr->text, addr->iface);
+			}
+			if (added == 0) {
+				util_debug(1, "duplicate: %s", res->name);
+				stats_inc(STATS_DUPLICATES);
+			} else {
+				util_debug(1, "more addresses for %s, now %s", res->name, run->url);
+			}
+			result_free(res);
+			return 0;
+		}
+	}
+
+	if (my_results == NULL) {
+		atexit(result_cleanup);
+	}
+	res->next = my_results;
+	my_results = res;
+	my_count++;
+
+	return 1;
+}
+
+
+/*
+ * Remove the entries a probe found dead, returns how many went
+ */
+
+int
+result_drop_unreachable(void)
+{
+	result_t **pos, *tmp;
+	int count = 0;
+
+	for (pos = &my_results; *pos != NULL; ) {
+		if ((*pos)->reachable != 0) {
+			pos = &(*pos)->next;
+			continue;
+		}
+		util_info("drop unreachable %s (%s)", (*pos)->url, (*pos)->name);
+		tmp = *pos;
+		*pos = tmp->next;
+		result_free(tmp);
+		my_count--;
+		count++;
+	}
+
+	return count;
+}
+
+
+result_t *
+result_get_list(void)
+{
+	return my_results;
+}
+
+
+int
+result_get_count(void)
+{
+	return my_count;
+}
+
+
+
+/*
+ * The Types command collects service types like "_http._tcp" instead
+ * of instances. Both backends report each type once per interface, so
+ * the list is kept sorted and without duplicates. Returns 1 if new.
+ */
+
+int
+result_add_type(const char *type)
+{
+	txt_t **run, *ptr;
+	int cmp;
+
+	for (run = &my_types; *run != NULL; run = &(*run)->next) {
+		if ((cmp = strcasecmp((*run)->text, type)) == 0) {
+			return 0;
+		}
+		if (cmp > 0) {
+			break;
+		}
+	}
+	if (my_type_count == RESULT_TYPES) {
+		util_error(__func__, __LINE__, "too many service types, skip %s", type);
+		return 0;
+	}
+
+	ptr = util_malloc(sizeof(txt_t));
+	UTIL_STRCPY(ptr->text, type);
+	ptr->next = *run;
+	*run = ptr;
+	my_type_count++;
+
+	return 1;
+}
+
+
+int
+result_get_type_count(void)
+{
+	return my_type_count;
+}
+
+/*
+ * Results are sorted by name (then URL) so that a continuation token
+ * stays valid even though the next lookup sees the answers in another order.
+ */
+
+static int
+result_compare(const char *name1, const char *url1, const char *name2, const char *url2)
+{
+	int cmp;
+
+	if ((cmp = strcasecmp(name1, name2)) != 0) {
+		return cmp;
+	}
+
+	return strcmp(url1, url2);
+}
+
+
+static int
+result_compare_qsort(const void *one, const void *two)
+{
+	const result_t *r1 = *(result_t * const *) one;
+	const result_t *r2 = *(result_t * const *) two;
+
+	return result_compare(r1->name, r1->url, r2->name, r2->url);
+}
+
+
+result_t *
+result_sort(void)
+{
+	result_t **arr, *run;
+	int num;
+
+	if (my_count < 2) {
+		return my_results;
+	}
+
+	arr = util_malloc(my_count * sizeof(result_t *));
+	for (num = 0, run = my_results; run != NULL; run = run->next) {
+		arr[num++] = run;
+	}
+	qsort(arr, num, sizeof(result_t *), result_compare_qsort);
+
+	for (my_results = arr[0], num = 1; num < my_count; num++) {
+		arr[num-1]->next = arr[num];
+	}
+	arr[my_count-1]->next = NULL;
+	util_free(arr);
+
+	return my_results;
+}
+
+
+/*
+ * The continuation token is "<url> <name>" of the last entry sent
+ */
+
+char *
+result_token(const result_t *res, char *dst, size_t len)
+{
+	snprintf(dst, len, "%s %s", res->url, res->name);
+
+	return dst;
+}
+
+
+int
+result_after(const result_t *res, const char *token)
+{
+	char url[1024];
+	const char *name;
+	size_t siz;
+
+	if (token == NULL || *token == '\0') {
+		return 1;
+	}
+	if ((name = strchr(token, ' ')) == NULL) {
+		return 1;
+	}
+	if ((siz = (size_t) (name - token)) >= sizeof(url)) {
+		siz = sizeof(url) - 1;
+	}
+	memcpy(url, token, siz);
+	url[siz] = '\0';
+
+	return result_compare(res->name, res->url, name + 1, url) > 0;
+}
+
+
+/*
+ * Drop the last TXT record, for an entry too big to send. Returns 0
+ * if there is none left.
+ */
+
+int
+result_trim_txt(result_t *res)
+{
+	txt_t **run;
+
+	if (res->txt == NULL) {
+		return 0;
+	}
+	for (run = &res->txt; (*run)->next != NULL; run = &(*run)->next) {
+		continue;
+	}
+	util_free(*run);
+	*run = NULL;
+
+	return 1;
+}
+
+
+/*
+ * Small writers for result_format(), all of them keep dst terminated
+ */
+
+static size_t
+result_put(char *dst, size_t len, size_t ofs, const char *str)
+{
+	size_t siz = strlen(str);
+
+	if (ofs + siz >= len) {
+		siz = (ofs < len) ? len - ofs - 1 : 0;
+	}
+	memcpy(dst + ofs, str, siz);
+	dst[ofs + siz] = '\0';
+
+	return ofs + siz;
+}
+
+
+static size_t
+result_put_string(char *dst, size_t len, size_t ofs, const char *str)
+{
+	ofs = result_put(dst, len, ofs, "\"");
+	ofs += util_json_escape(dst + ofs, len - ofs, str);
+
+	return result_put(dst, len, ofs, "\"");
+}
+
+
+/*
+ * Format one entry either indented (like before) or compact.
+ * All strings are JSON escaped, a quote in a name must not break the reply.
+ */
+
+size_t
+result_format(const result_t *res, char *dst, size_t len, int compact)
+{
+	const char *sep, *ind, *nxt;
+	const txt_t *txt;
+	const addr_t *addr;
+	char num[32];
+	size_t ofs;
+	int count;
+
+	sep = compact ? ":"  : ": ";
+	ind = compact ? ""   : "      ";
+	nxt = compact ? ","  : ",\n";
+
+	ofs = result_put(dst, len, 0, compact ? "{" : "    {\n");
+
+	ofs = result_put(dst, len, ofs, ind);
+	ofs = result_put(dst, len, ofs, "\"name\"");
+	ofs = result_put(dst, len, ofs, sep);
+	ofs = result_put_string(dst, len, ofs, res->name);
+	ofs = result_put(dst, len, ofs, nxt);
+
+	ofs = result_put(dst, len, ofs, ind);
+	ofs = result_put(dst, len, ofs, "\"txt\"");
+	ofs = result_put(dst, len, ofs, sep);
+	ofs = result_put(dst, len, ofs, compact ? "[" : "[ ");
+	for (txt = res->txt; txt != NULL; txt = txt->next) {
+		ofs = result_put_string(dst, len, ofs, txt->text);
+		if (txt->next != NULL) {
+			ofs = result_put(dst, len, ofs, compact ? "," : ", ");
+		} else if (compact == 0) {
+			ofs = result_put(dst, len, ofs, " ");
+		}
+	}
+	ofs = result_put(dst, len, ofs, "]");
+	ofs = result_put(dst, len, ofs, nxt);
+
+	ofs = result_put(dst, len, ofs, ind);
+	ofs = result_put(dst, len, ofs, "\"target\"");
+	ofs = result_put(dst, len, ofs, sep);
+	ofs = result_put_string(dst, len, ofs, res->target);
+	ofs = result_put(dst, len, ofs, nxt);
+
+	snprintf(num, sizeof(num), "%d", res->port);
+	ofs = result_put(dst, len, ofs, ind);
+	ofs = result_put(dst, len, ofs, "\"port\"");
+	ofs = result_put(dst, len, ofs, sep);
+	ofs = result_put(dst, len, ofs, num);
+	ofs = result_put(dst, len, ofs, nxt);
+
+	ofs = result_put(dst, len, ofs, ind);
+	ofs = result_put(dst, len, ofs, "\"a\"");
+	ofs = result_put(dst, len, ofs, sep);
+	ofs = result_put_string(dst, len, ofs, res->a);
+	ofs = result_put(dst, len, ofs, nxt);
+
+	ofs = result_put(dst, len, ofs, ind);
+	ofs = result_put(dst, len, ofs, "\"url\"");
+	ofs = result_put(dst, len, ofs, sep);
+	ofs = result_put_string(dst, len, ofs, res->url);
+	ofs = result_put(dst, len, ofs, nxt);
+
+	ofs = result_put(dst, len, ofs, ind);
+	ofs = result_put(dst, len, ofs, "\"addresses\"");
+	ofs = result_put(dst, len, ofs, sep);
+	ofs = result_put(dst, len, ofs, compact ? "[" : "[ ");
+	for (addr = res->addrs; addr != NULL; addr = addr->next) {
+		ofs = result_put_string(dst, len, ofs, addr->text);
+		if (addr->next != NULL) {
+			ofs = result_put(dst, len, ofs, compact ? "," : ", ");
+		} else if (compact == 0) {
+			ofs = result_put(dst, len, ofs, " ");
+		}
+	}
+	ofs = result_put(dst, len, ofs, "]");
+
+	if (res->type != NULL) {
+		ofs = result_put(dst, len, ofs, nxt);
+		ofs = result_put(dst, len, ofs, ind);
+		ofs = result_put(dst, len, ofs, "\"type\"");
+		ofs = result_put(dst, len, ofs, sep);
+		ofs = result_put_string(dst, len, ofs, res->type);
+	}
+	if (res->source != 0) {
+		ofs = result_put(dst, len, ofs, nxt);
+		ofs = result_put(dst, len, ofs, ind);
+		ofs = result_put(dst, len, ofs, "\"source\"");
+		ofs = result_put(dst, len, ofs, sep);
+		ofs = result_put(dst, len, ofs, res->source == RESULT_AVAHI ? "\"avahi\"" :
+				res->source == RESULT_QUERY ? "\"query\"" : "\"both\"");
+	}
+	if (res->cached) {
+		ofs = result_put(dst, len, ofs, nxt);
+		ofs = result_put(dst, len, ofs, ind);
+		ofs = result_put(dst, len, ofs, "\"cached\"");
+		ofs = result_put(dst, len, ofs, sep);
+		ofs = result_put(dst, len, ofs, "true");
+	}
+
+	for (addr = res->addrs, count = 0; addr != NULL; addr = addr->next) {
+		if (addr->rtt_ms < 0.0) {
+			continue;
+		}
+		ofs = result_put(dst, len, ofs, count++ == 0 ? nxt : (compact ? "," : ", "));
+		if (count == 1) {
+			ofs = result_put(dst, len, ofs, ind);
+			ofs = result_put(dst, len, ofs, "\"rtt_ms\"");
+			ofs = result_put(dst, len, ofs, sep);
+			ofs = result_put(dst, len, ofs, compact ? "{" : "{ ");
+		}
+		snprintf(num, sizeof(num), "%.3f", addr->rtt_ms);
+		ofs = result_put_string(dst, len, ofs, addr->text);
+		ofs = result_put(dst, len, ofs, sep);
+		ofs = result_put(dst, len, ofs, num);
+	}
+	if (count > 0) {
+		ofs = result_put(dst, len, ofs, compact ? "}" : " }");
+	}
+
+	if (res->reachable >= 0) {
+		ofs = result_put(dst, len, ofs, nxt);
+		ofs = result_put(dst, len, ofs, ind);
+		ofs = result_put(dst, len, ofs, "\"reachable\"");
+		ofs = result_put(dst, len, ofs, sep);
+		ofs = result_put(dst, len, ofs, res->reachable ? "true" : "false");
+	}
+	if (res->connect_ms >= 0.0) {
+		snprintf(num, sizeof(num), "%.3f", res->connect_ms);
+		ofs = result_put(dst, len, ofs, nxt);
+		ofs = result_put(dst, len, ofs, ind);
+		ofs = result_put(dst, len, ofs, "\"connect_ms\"");
+		ofs = result_put(dst, len, ofs, sep);
+		ofs = result_put(dst, len, ofs, num);
+	}
+
+	if (res->addrs->iface[0] != '\0') {
+		ofs = result_put(dst, len, ofs, nxt);
+		ofs = result_put(dst, len, ofs, ind);
+		ofs = result_put(dst, len, ofs, "\"interface\"");
+		ofs = result_put(dst, len, ofs, sep);
+		ofs = result_put_string(dst, len, ofs, res->addrs->iface);
+	}
+
+	return result_put(dst, len, ofs, compact ? "}" : "\n    }");
+}
+
+
+/*
+ * The service types as a JSON array
+ */
+
+size_t
+result_format_types(char *dst, size_t len, int compact)
+{
+	const txt_t *txt;
+	size_t ofs;
+
+	ofs = result_put(dst, len, 0, compact ? "[" : "[ ");
+	for (txt = my_types; txt != NULL; txt = txt->next) {
+		ofs = result_put_string(dst, len, ofs, txt->text);
+		if (txt->next != NULL) {
+			ofs = result_put(dst, len, ofs, compact ? "," : ", ");
+		} else if (compact == 0) {
+			ofs = result_put(dst, len, ofs, " ");
+		}
+	}
+
+	return result_put(dst, len, ofs, "]");
+}
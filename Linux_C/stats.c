@@ -0,0 +1,168 @@
+/****************************************************************************
+ *
+ * Copyright (c) 2017-2018 Volker Wiegand <volker@railduino.de>
+ *
+ * This file is part of Zeroconf-Lookup.
+ * Project home: https://www.railduino.de/zeroconf-lookup
+ * Source code:  https://github.com/railduino/zeroconf-lookup.git
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ ****************************************************************************/
+
+#include "common.h"
+
+
+/*
+ * Discovery counters for one run, printed in the text exposition format
+ */
+
+#define STATS_REASONS	16
+
+typedef struct {
+	const char	*name;
+	const char	*label;		// NULL for a plain counter
+	const char	*help;
+} stats_info_t;
+
+static const stats_info_t my_info[STATS_COUNT] = {
+	{ "zeroconf_packets_total",           "qr=\"response\"", "mDNS packets received, by QR flag" },
+	{ "zeroconf_packets_total",           "qr=\"query\"",    NULL },
+	{ "zeroconf_unknown_rr_total",        NULL, "Resource records of a type the parser skips" },
+	{ "zeroconf_incomplete_answers_total",NULL, "Answers without name, address or port" },
+	{ "zeroconf_duplicates_total",        NULL, "Results suppressed as duplicates" },
+	{ "zeroconf_resolver_failures_total", NULL, "Avahi resolvers that failed" },
+	{ "zeroconf_resolver_timeouts_total", NULL, "Avahi resolvers still running at the deadline" },
+	{ "zeroconf_coalesced_total",         NULL, "Avahi browse events for an instance already resolving" },
+	{ "zeroconf_rxq_overflows_total",     NULL, "Packets dropped by the socket receive queue (SO_RXQ_OVFL)" },
+};
+
+static unsigned long my_counters[STATS_COUNT];
+
+static char          my_reasons[STATS_REASONS][64];
+static unsigned long my_reason_counts[STATS_REASONS];
+static int           my_reason_cnt = 0;
+
+
+void
+stats_inc(int counter)
+{
+	if (counter >= 0 && counter < STATS_COUNT) {
+		my_counters[counter]++;
+	}
+}
+
+
+void
+stats_add(int counter, unsigned long value)
+{
+	if (counter >= 0 && counter < STATS_COUNT) {
+		my_counters[counter] += value;
+	}
+}
+
+
+void
+stats_set(int counter, unsigned long value)
+{
+	if (counter >= 0 && counter < STATS_COUNT) {
+		my_counters[counter] = value;
+	}
+}
+
+
+unsigned long
+stats_get(int counter)
+{
+	if (counter >= 0 && counter < STATS_COUNT) {
+		return my_counters[counter];
+	}
+
+	return 0;
+}
+
+
+/*
+ * Packets dropped by the parser, labeled with the reason
+ */
+
+void
+stats_parse_error(const char *reason)
+{
+	int idx;
+
+	for (idx = 0; idx < my_reason_cnt; idx++) {
+		if (strcmp(my_reasons[idx], reason) == 0) {
+			my_reason_counts[idx]++;
+			return;
+		}
+	}
+
+	if (my_reason_cnt == STATS_REASONS) {
+		idx = STATS_REASONS - 1;	// lump the rest together
+		UTIL_STRCPY(my_reasons[idx], "other");
+		my_reason_counts[idx]++;
+		return;
+	}
+
+	UTIL_STRCPY(my_reasons[my_reason_cnt], reason);
+	my_reason_counts[my_reason_cnt++] = 1;
+}
+
+
+size_t
+stats_format(char *dst, size_t len)
+{
+	size_t ofs = 0;
+	int idx;
+
+	if (len == 0) {
+		return 0;
+	}
+	*dst = '\0';
+
+	for (idx = 0; idx < STATS_COUNT && ofs < len; idx++) {
+		if (my_info[idx].help != NULL) {
+			ofs += snprintf(dst + ofs, len - ofs, "# HELP %s %s\n# TYPE %s counter\n",
+					my_info[idx].name, my_info[idx].help, my_info[idx].name);
+		}
+		if (ofs >= len) {
+			break;
+		}
+		if (my_info[idx].label != NULL) {
+			ofs += snprintf(dst + ofs, len - ofs, "%s{%s} %lu\n",
+					my_info[idx].name, my_info[idx].label, my_counters[idx]);
+		} else {
+			ofs += snprintf(dst + ofs, len - ofs, "%s %lu\n",
+					my_info[idx].name, my_counters[idx]);
+		}
+	}
+
+	if (ofs < len) {
+		ofs += snprintf(dst + ofs, len - ofs, "# HELP %s %s\n# TYPE %s counter\n",
+				"zeroconf_parse_errors_total", "mDNS packets dropped by the parser, by reason",
+				"zeroconf_parse_errors_total");
+	}
+	for (idx = 0; idx < my_reason_cnt && ofs < len; idx++) {
+		ofs += snprintf(dst + ofs, len - ofs, "zeroconf_parse_errors_total{reason=\"%s\"} %lu\n",
+				my_reasons[idx], my_reason_counts[idx]);
+	}
+
+	return (ofs < len) ? ofs : len - 1;
+}
@@ -0,0 +1,160 @@
+/****************************************************************************
+ *
+ * Copyright (c) 2017-2018 Volker Wiegand <volker@railduino.de>
+ *
+ * This file is part of Zeroconf-Lookup.
+ * Project home: https://www.railduino.de/zeroconf-lookup
+ * Source code:  https://github.com/railduino/zeroconf-lookup.git
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ ****************************************************************************/
+
+#include "common.h"
+
+#include <time.h>
+
+
+/*
+ * Monotonic timestamps for the phases of one lookup. Marks are kept
+ * as the first occurrence, except for the last answer and the write.
+ * The discovery phases belong to the backend that answered, see
+ * timing_fallback().
+ */
+
+static const char *my_names[TIMING_COUNT] = {
+	"start", "config", "fallback", "init", "sent", "first", "last", "stop", "probe", "serialize", "write"
+};
+
+static struct timespec my_marks[TIMING_COUNT];
+static int             my_valid[TIMING_COUNT];
+
+
+static void
+timing_now(int phase)
+{
+	clock_gettime(CLOCK_MONOTONIC, &my_marks[phase]);
+	my_valid[phase] = 1;
+}
+
+
+void
+timing_mark(int phase)
+{
+	if (phase < 0 || phase >= TIMING_COUNT) {
+		return;
+	}
+
+	if (my_valid[phase] == 0 || phase == TIMING_LAST || phase == TIMING_WRITE) {
+		timing_now(phase);
+	}
+}
+
+
+void
+timing_answer(void)
+{
+	timing_mark(TIMING_FIRST);
+	timing_mark(TIMING_LAST);
+}
+
+
+/*
+ * The query runs after Avahi came back empty: forget the Avahi phases so
+ * that init, sent, first, last and stop describe the query. The time the
+ * Avahi attempt took shows as "fallback".
+ */
+
+void
+timing_fallback(void)
+{
+	int phase;
+
+	timing_now(TIMING_FALLBACK);
+	for (phase = TIMING_INIT; phase <= TIMING_STOP; phase++) {
+		my_valid[phase] = 0;
+	}
+}
+
+
+/*
+ * Milliseconds since process start, or -1 if the phase was not reached
+ */
+
+static double
+timing_elapsed(int phase)
+{
+	if (my_valid[phase] == 0 || my_valid[TIMING_START] == 0) {
+		return -1.0;
+	}
+
+	return (my_marks[phase].tv_sec  - my_marks[TIMING_START].tv_sec)  * 1000.0 +
+	       (my_marks[phase].tv_nsec - my_marks[TIMING_START].tv_nsec) / 1000000.0;
+}
+
+
+/*
+ * Writes the "timing" member (including a leading comma) for the response;
+ * phases that were not reached are left out. Returns the length written.
+ */
+
+size_t
+timing_format(char *dst, size_t len, int compact)
+{
+	size_t ofs;
+	int phase, count;
+
+	if (len == 0) {
+		return 0;
+	}
+
+	ofs = snprintf(dst, len, compact ? ",\"timing\":{" : ",\n  \"timing\": {");
+	for (phase = TIMING_START + 1, count = 0; phase < TIMING_COUNT && ofs < len; phase++) {
+		if (timing_elapsed(phase) < 0.0) {
+			continue;
+		}
+		ofs += snprintf(dst + ofs, len - ofs, compact ? "%s\"%s_ms\":%.3f" : "%s \"%s_ms\": %.3f",
+				count > 0 ? "," : "", my_names[phase], timing_elapsed(phase));
+		count++;
+	}
+	if (ofs < len) {
+		ofs += snprintf(dst + ofs, len - ofs, compact ? "}" : " }");
+	}
+
+	return (ofs < len) ? ofs : len - 1;
+}
+
+
+void
+timing_log(void)
+{
+	char buffer[512];
+	size_t ofs = 0;
+	int phase;
+
+	*buffer = '\0';
+	for (phase = TIMING_START + 1; phase < TIMING_COUNT && ofs < sizeof(buffer); phase++) {
+		if (timing_elapsed(phase) < 0.0) {
+			continue;
+		}
+		ofs += snprintf(buffer + ofs, sizeof(buffer) - ofs, " %s=%.3f", my_names[phase], timing_elapsed(phase));
+	}
+
+	util_info("timing (ms):%s", buffer);
+}
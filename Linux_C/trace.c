@@ -0,0 +1,237 @@
+/****************************************************************************
+ *
+ * Copyright (c) 2017-2018 Volker Wiegand <volker@railduino.de>
+ *
+ * This file is part of Zeroconf-Lookup.
+ * Project home: https://www.railduino.de/zeroconf-lookup
+ * Source code:  https://github.com/railduino/zeroconf-lookup.git
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ ****************************************************************************/
+
+#include "common.h"
+
+#include <time.h>
+
+
+/*
+ * Chrome trace-event / Perfetto JSON, written while the lookup runs.
+ * Timestamps are microseconds since trace_open(); responders get a lane
+ * of their own so arrival times line up on one timeline.
+ */
+
+#define TRACE_RESPONDERS	256
+
+static FILE           *my_fp     = NULL;
+static int             my_events = 0;
+static int             my_pid    = 0;
+static struct timespec my_start;
+
+static char my_responders[TRACE_RESPONDERS][64];
+static int  my_responder_count = 0;
+
+
+static void
+trace_close(void)
+{
+	if (my_fp != NULL) {
+		fprintf(my_fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
+		fclose(my_fp);
+		my_fp = NULL;
+	}
+}
+
+
+/*
+ * Every event starts the same way; the caller adds the rest and the '}'
+ */
+
+static void
+trace_head(char phase, int lane, const char *cat, const char *name, uint64_t ts)
+{
+	char escaped[512];
+
+	util_json_escape(escaped, sizeof(escaped), name);
+	fprintf(my_fp, "%s{\"ph\":\"%c\",\"pid\":%d,\"tid\":%d,\"cat\":\"%s\",\"name\":\"%s\",\"ts\":%llu",
+			my_events++ > 0 ? ",\n" : "", phase, my_pid, lane, cat, escaped, (unsigned long long) ts);
+}
+
+
+static void
+trace_args(const char *detail, int count)
+{
+	char escaped[2048];
+
+	if (detail == NULL && count < 0) {
+		fprintf(my_fp, "}");
+		return;
+	}
+
+	fprintf(my_fp, ",\"args\":{");
+	if (detail != NULL) {
+		util_json_escape(escaped, sizeof(escaped), detail);
+		fprintf(my_fp, "\"detail\":\"%s\"%s", escaped, count >= 0 ? "," : "");
+	}
+	if (count >= 0) {
+		fprintf(my_fp, "\"count\":%d", count);
+	}
+	fprintf(my_fp, "}}");
+}
+
+
+void
+trace_lane(int lane, const char *label)
+{
+	char escaped[256];
+
+	if (my_fp == NULL) {
+		return;
+	}
+
+	util_json_escape(escaped, sizeof(escaped), label);
+	fprintf(my_fp, "%s{\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"name\":\"thread_name\",\"args\":{\"name\":\"%s\"}}",
+			my_events++ > 0 ? ",\n" : "", my_pid, lane, escaped);
+}
+
+
+void
+trace_open(char *file)
+{
+	if ((my_fp = fopen(file, "w")) == NULL) {
+		util_error(__func__, __LINE__, "can't create trace %s: %s", file, strerror(errno));
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &my_start);
+	my_pid = (int) getpid();
+	atexit(trace_close);
+
+	fprintf(my_fp, "{\"traceEvents\":[\n");
+	trace_lane(TRACE_LANE_MAIN,  "main");
+	trace_lane(TRACE_LANE_AVAHI, "avahi");
+	trace_lane(TRACE_LANE_QUERY, "mdns socket");
+	util_info("writing trace events to %s", file);
+}
+
+
+int
+trace_enabled(void)
+{
+	return my_fp != NULL;
+}
+
+
+uint64_t
+trace_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t) (now.tv_sec - my_start.tv_sec) * 1000000 +
+		(now.tv_nsec - my_start.tv_nsec) / 1000;
+}
+
+
+/*
+ * Lane for one responder address, named on first sight
+ */
+
+int
+trace_responder(const char *addr)
+{
+	int idx;
+
+	if (my_fp == NULL) {
+		return TRACE_LANE_QUERY;
+	}
+
+	for (idx = 0; idx < my_responder_count; idx++) {
+		if (strcmp(my_responders[idx], addr) == 0) {
+			return TRACE_LANE_RESPONDER + idx;
+		}
+	}
+	if (my_responder_count == TRACE_RESPONDERS) {
+		return TRACE_LANE_QUERY;
+	}
+
+	UTIL_STRCPY(my_responders[my_responder_count], addr);
+	trace_lane(TRACE_LANE_RESPONDER + my_responder_count, addr);
+
+	return TRACE_LANE_RESPONDER + my_responder_count++;
+}
+
+
+void
+trace_instant(int lane, const char *cat, const char *name, const char *detail)
+{
+	if (my_fp == NULL) {
+		return;
+	}
+
+	trace_head('i', lane, cat, name, trace_now());
+	fprintf(my_fp, ",\"s\":\"t\"");
+	trace_args(detail, -1);
+}
+
+
+void
+trace_complete(int lane, const char *cat, const char *name, uint64_t start, const char *detail, int count)
+{
+	uint64_t now;
+
+	if (my_fp == NULL) {
+		return;
+	}
+
+	now = trace_now();
+	trace_head('X', lane, cat, name, start);
+	fprintf(my_fp, ",\"dur\":%llu", (unsigned long long) (now - start));
+	trace_args(detail, count);
+}
+
+
+/*
+ * Async begin/end pairs (one per resolver) show how many run at once
+ */
+
+void
+trace_begin(const char *cat, const char *name, const void *id, const char *detail)
+{
+	if (my_fp == NULL) {
+		return;
+	}
+
+	trace_head('b', TRACE_LANE_AVAHI, cat, name, trace_now());
+	fprintf(my_fp, ",\"id\":\"%p\"", id);
+	trace_args(detail, -1);
+}
+
+
+void
+trace_end(const char *cat, const char *name, const void *id, const char *detail)
+{
+	if (my_fp == NULL) {
+		return;
+	}
+
+	trace_head('e', TRACE_LANE_AVAHI, cat, name, trace_now());
+	fprintf(my_fp, ",\"id\":\"%p\"", id);
+	trace_args(detail, -1);
+}
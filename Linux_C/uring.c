@@ -0,0 +1,358 @@
+/****************************************************************************
+ *
+ * Copyright (c) 2017-2018 Volker Wiegand <volker@railduino.de>
+ *
+ * This file is part of Zeroconf-Lookup.
+ * Project home: https://www.railduino.de/zeroconf-lookup
+ * Source code:  https://github.com/railduino/zeroconf-lookup.git
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ ****************************************************************************/
+
+#include "common.h"
+
+#include <linux/io_uring.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+
+/*
+ * Receive path for the mDNS sockets on io_uring: one multishot
+ * recvmsg per socket stays armed and the kernel writes every datagram
+ * into a buffer from a provided buffer ring. The ring descriptor sits
+ * in the event loop, a wakeup reaps all completions without another
+ * syscall per packet.
+ *
+ * There is no liburing dependency, the few syscalls are made directly.
+ * Multishot recvmsg needs Linux 6.0, older kernels (or io_uring
+ * disabled by sysctl or seccomp) make uring_open() fail or report the
+ * socket back with a NULL buffer, query.c then reads it the old way.
+ */
+
+#define URING_ENTRIES	8		// submission queue, one SQE per socket
+#define URING_BUFFERS	64		// provided buffers, a power of 2
+#define URING_CQES	(4 * URING_BUFFERS)	// completions between two wakeups
+#define URING_ROOM	256		// recvmsg_out, address and control data
+#define URING_GROUP	1		// buffer group id
+#define URING_SOCKS	2
+
+
+typedef struct {
+	int		fd;
+	struct msghdr	msg;		// only the name and control sizes count
+	void		(*callback)(int sock, char *buf, int len, struct msghdr *msg);
+} uring_sock_t;
+
+
+static int           my_fd      = -1;
+static void         *my_ring    = MAP_FAILED;
+static size_t        my_ring_size;
+static struct io_uring_sqe *my_sqes = MAP_FAILED;
+static size_t        my_sqes_size;
+static unsigned int *my_sq_tail, *my_sq_mask, *my_sq_array, *my_sq_flags;
+static unsigned int *my_cq_head, *my_cq_tail, *my_cq_mask;
+static struct io_uring_cqe *my_cqes;
+static struct io_uring_buf_ring *my_bufs = MAP_FAILED;
+static uint16_t      my_buf_tail = 0;
+static char         *my_data    = NULL;
+static int           my_bufsize = 0;
+static uring_sock_t  my_socks[URING_SOCKS];
+static int           my_sock_cnt = 0;
+static loop_watch_t *my_watch   = NULL;
+
+
+/*
+ * Hand a buffer (back) to the kernel
+ */
+
+static void
+uring_recycle(int bid)
+{
+	struct io_uring_buf *buf = &my_bufs->bufs[my_buf_tail & (URING_BUFFERS - 1)];
+
+	buf->addr = (uintptr_t) (my_data + bid * my_bufsize);
+	buf->len  = my_bufsize - 1;	// room for the '\0' of query.c
+	buf->bid  = bid;
+	__atomic_store_n(&my_bufs->tail, ++my_buf_tail, __ATOMIC_RELEASE);
+}
+
+
+static int
+uring_arm(int idx)
+{
+	unsigned int tail = *my_sq_tail, pos = tail & *my_sq_mask;
+	struct io_uring_sqe *sqe = &my_sqes[pos];
+
+	memset(sqe, '\0', sizeof(*sqe));
+	sqe->opcode    = IORING_OP_RECVMSG;
+	sqe->fd        = my_socks[idx].fd;
+	sqe->addr      = (uintptr_t) &my_socks[idx].msg;
+	sqe->len       = 1;
+	sqe->ioprio    = IORING_RECV_MULTISHOT;
+	sqe->flags     = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_GROUP;
+	sqe->user_data = idx;
+
+	my_sq_array[pos] = pos;
+	__atomic_store_n(my_sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	if (syscall(__NR_io_uring_enter, my_fd, 1, 0, 0, NULL, 0) < 0) {
+		util_error(__func__, __LINE__, "io_uring_enter: %s", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * A buffer holds struct io_uring_recvmsg_out, then the address and
+ * the control data in the sizes of the armed msghdr, then the payload
+ */
+
+static void
+uring_deliver(uring_sock_t *sock, char *buf, int res)
+{
+	struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *) buf;
+	char *name    = buf + sizeof(*out);
+	char *control = name + sock->msg.msg_namelen;
+	char *payload = control + sock->msg.msg_controllen;
+	struct msghdr msg;
+
+	if (res < (int) (payload - buf)) {
+		util_error(__func__, __LINE__, "short io_uring buffer (%d bytes)", res);
+		return;
+	}
+
+	memset(&msg, '\0', sizeof(msg));
+	msg.msg_name       = name;
+	msg.msg_namelen    = out->namelen < sock->msg.msg_namelen ? out->namelen : sock->msg.msg_namelen;
+	msg.msg_control    = control;
+	msg.msg_controllen = out->controllen;
+	msg.msg_flags      = out->flags;
+
+	sock->callback(sock->fd, payload, res - (int) (payload - buf), &msg);
+}
+
+
+static void
+uring_complete(struct io_uring_cqe *cqe)
+{
+	uring_sock_t *sock = &my_socks[cqe->user_data];
+	int bid;
+
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		if (cqe->res > 0) {
+			uring_deliver(sock, my_data + bid * my_bufsize, cqe->res);
+		}
+		uring_recycle(bid);
+	}
+	if (cqe->flags & IORING_CQE_F_MORE) {
+		return;
+	}
+
+	//
+	// Out of buffers ends the multishot, the reaping loop freed them again
+	//
+	if (cqe->res >= 0 || cqe->res == -ENOBUFS) {
+		if (uring_arm(cqe->user_data) == 0) {
+			return;
+		}
+	} else {
+		util_info("io_uring recvmsg ended: %s", strerror(-cqe->res));
+	}
+	sock->callback(sock->fd, NULL, cqe->res < 0 ? cqe->res : -EIO, NULL);
+}
+
+
+static void
+uring_readable(int fd, unsigned int events, void *data)
+{
+	unsigned int head, tail;
+
+	(void) events;
+	(void) data;
+
+	for (;;) {
+		head = *my_cq_head;
+		tail = __atomic_load_n(my_cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			uring_complete(&my_cqes[head & *my_cq_mask]);
+		}
+		__atomic_store_n(my_cq_head, head, __ATOMIC_RELEASE);
+
+		//
+		// Completions that didn't fit wait in the kernel until asked for
+		//
+		if ((__atomic_load_n(my_sq_flags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW) == 0) {
+			break;
+		}
+		util_debug(2, "io_uring completion queue overflow");
+		if (syscall(__NR_io_uring_enter, fd, 0, 0, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+			break;
+		}
+	}
+}
+
+
+void
+uring_close(void)
+{
+	loop_watch_free(my_watch);
+	my_watch = NULL;
+
+	if (my_fd >= 0) {
+		close(my_fd);		// cancels the armed requests
+		my_fd = -1;
+	}
+	if (my_bufs != MAP_FAILED) {
+		munmap(my_bufs, URING_BUFFERS * sizeof(struct io_uring_buf));
+		my_bufs = MAP_FAILED;
+	}
+	if (my_sqes != MAP_FAILED) {
+		munmap(my_sqes, my_sqes_size);
+		my_sqes = MAP_FAILED;
+	}
+	if (my_ring != MAP_FAILED) {
+		munmap(my_ring, my_ring_size);
+		my_ring = MAP_FAILED;
+	}
+	if (my_data != NULL) {
+		util_free(my_data);
+		my_data = NULL;
+	}
+	my_sock_cnt = 0;
+}
+
+
+/*
+ * Set up the ring and the provided buffers for datagrams up to size
+ * bytes. Returns -1 if the kernel can't do it, nothing is left open.
+ */
+
+int
+uring_open(int size)
+{
+	struct io_uring_params params;
+	struct io_uring_buf_reg reg;
+	size_t cq_size;
+	char *ring;
+	int bid;
+
+	memset(&params, '\0', sizeof(params));
+	params.flags      = IORING_SETUP_CQSIZE;
+	params.cq_entries = URING_CQES;
+	if ((my_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params)) < 0) {
+		util_info("io_uring not available: %s", strerror(errno));
+		return -1;
+	}
+	if ((params.features & IORING_FEAT_SINGLE_MMAP) == 0) {
+		util_info("io_uring too old (no single mmap)");
+		uring_close();
+		return -1;
+	}
+
+	my_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (cq_size > my_ring_size) {
+		my_ring_size = cq_size;
+	}
+	my_sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	my_ring = mmap(NULL, my_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, my_fd, IORING_OFF_SQ_RING);
+	my_sqes = mmap(NULL, my_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, my_fd, IORING_OFF_SQES);
+	my_bufs = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (my_ring == MAP_FAILED || my_sqes == MAP_FAILED || my_bufs == MAP_FAILED) {
+		util_error(__func__, __LINE__, "io_uring mmap: %s", strerror(errno));
+		uring_close();
+		return -1;
+	}
+
+	ring = my_ring;
+	my_sq_tail  = (unsigned int *) (ring + params.sq_off.tail);
+	my_sq_mask  = (unsigned int *) (ring + params.sq_off.ring_mask);
+	my_sq_array = (unsigned int *) (ring + params.sq_off.array);
+	my_sq_flags = (unsigned int *) (ring + params.sq_off.flags);
+	my_cq_head  = (unsigned int *) (ring + params.cq_off.head);
+	my_cq_tail  = (unsigned int *) (ring + params.cq_off.tail);
+	my_cq_mask  = (unsigned int *) (ring + params.cq_off.ring_mask);
+	my_cqes     = (struct io_uring_cqe *) (ring + params.cq_off.cqes);
+
+	//
+	// Provided buffer rings came with Linux 5.19
+	//
+	memset(&reg, '\0', sizeof(reg));
+	reg.ring_addr    = (uintptr_t) my_bufs;
+	reg.ring_entries = URING_BUFFERS;
+	reg.bgid         = URING_GROUP;
+	if (syscall(__NR_io_uring_register, my_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		util_info("io_uring without provided buffer rings: %s", strerror(errno));
+		uring_close();
+		return -1;
+	}
+
+	my_bufsize  = URING_ROOM + size + 1;
+	my_data     = util_malloc(URING_BUFFERS * my_bufsize);
+	my_buf_tail = 0;
+	for (bid = 0; bid < URING_BUFFERS; bid++) {
+		uring_recycle(bid);
+	}
+
+	my_watch = loop_watch_add(my_fd, EPOLLIN, uring_readable, NULL);
+	util_debug(1, "io_uring ready, %d buffers of %d bytes", URING_BUFFERS, my_bufsize);
+
+	return 0;
+}
+
+
+/*
+ * Keep a multishot recvmsg armed on sock. The callback gets every
+ * datagram with its address and control data; a NULL buffer (len is
+ * -errno then) means the ring gave up on the socket.
+ */
+
+int
+uring_recvmsg(int sock, socklen_t namelen, socklen_t controllen,
+		void (*callback)(int sock, char *buf, int len, struct msghdr *msg))
+{
+	uring_sock_t *entry;
+
+	if (my_fd < 0 || my_sock_cnt >= URING_SOCKS ||
+			sizeof(struct io_uring_recvmsg_out) + namelen + controllen > URING_ROOM) {
+		return -1;
+	}
+
+	entry = &my_socks[my_sock_cnt];
+	memset(entry, '\0', sizeof(*entry));
+	entry->fd       = sock;
+	entry->callback = callback;
+	entry->msg.msg_namelen    = namelen;
+	entry->msg.msg_controllen = controllen;
+
+	if (uring_arm(my_sock_cnt) < 0) {
+		return -1;
+	}
+	my_sock_cnt++;
+
+	return 0;
+}